@@ -11,6 +11,26 @@
 
 #include "mlock.h"
 
+#include <assert.h>   // For assert
+#include <pthread.h>  // For pthread_once and thread-exit destructors
+#include <stdint.h>   // For uint32_t and intptr_t
+#include <stdlib.h>   // For getenv and strtoul
+#include <time.h>     // For clock_gettime
+
+// sys/mman.h declares mlock(2), which clashes with the allocator's mlock
+#define mlock mlock_sys
+#include <sys/mman.h>  // For mmap
+#undef mlock
+
+#ifdef __linux__
+#include <linux/futex.h>  // For FUTEX_WAIT_PRIVATE and FUTEX_WAKE_PRIVATE
+#include <linux/memfd.h>  // For MFD_CLOEXEC
+#include <sys/syscall.h>  // For SYS_futex, SYS_mlock and SYS_memfd_create
+#include <unistd.h>       // For syscall, ftruncate and close
+#else
+#include <sched.h>  // For sched_yield
+#endif
+
 // ---[ DEBUG ]----------------------------------------------------------------
 
 #ifdef MLOCK_ENABLE_DEBUG
@@ -29,11 +49,145 @@
 #define DEBUG(...)
 #endif
 
+// ---[ TRACE ]----------------------------------------------------------------
+
+#if !defined(MLOCK_DISABLE_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+/**
+ * Static USDT probe in the mlock provider.  Costs a single NOP until a tracer
+ * such as bpftrace attaches, e.g. `bpftrace -e 'usdt:./app:mlock:mlock {}'`.
+ * @param name Name of the probe.
+ * @param __VA_ARGS__ Up to twelve integer or pointer arguments.
+ */
+#define TRACE(name, ...) STAP_PROBEV(mlock, name, ##__VA_ARGS__)
+#endif
+#endif
+
+#ifndef TRACE
+#define TRACE(name, ...)
+#endif
+
 // ---[ TYPES ]----------------------------------------------------------------
 
 typedef size_t word_t;  // A word; 64 bits in a 64-bit system
 typedef char byte_t;    // A byte; 8 bits
 
+/**
+ * Descriptor of a span: a run of memory that m-lock manages as one kind of
+ * thing.  Every page of a span maps to its descriptor in the page map.
+ */
+typedef struct {
+    int kind;       // What the span's memory is used for
+    byte_t* start;  // First byte of the span
+    size_t size;    // Size of the span in bytes
+    void* owner;    // Structure that manages the span, if any
+} span_t;
+
+/**
+ * What has been learned about the lifetime of blocks from one allocation
+ * site.
+ */
+typedef struct {
+    void* site;  // Return address of the site's call into m-lock
+    int score;   // Raised by short-lived blocks, lowered by long-lived ones
+} site_t;
+
+/**
+ * A slab: a page-aligned run of pool objects carved out of a heap block.
+ */
+typedef struct slab {
+    span_t span;         // The slab's pages, owned by its pool
+    byte_t* block;       // Heap block the slab was carved out of
+    span_t* block_span;  // Heap span the block's pages belong to
+    struct slab* next;   // Next slab of the same pool
+    unsigned live;       // Objects handed out to threads
+} slab_t;
+
+/**
+ * A pool of fixed-size objects.  Objects are handed out from thread caches,
+ * which refill from and flush to the pool's shared free list in batches.
+ * Free objects of a pool with a constructor or destructor stay constructed,
+ * so they are linked through a word after the object instead of its first.
+ */
+struct mlock_pool {
+    pthread_mutex_t lock;     // Guards every field below except id
+    size_t object_size;       // Bytes between the starts of adjacent objects
+    size_t link_offset;       // Offset of the free list link in an object
+    size_t slab_size;         // Bytes of objects in each slab
+    byte_t* free;             // Shared free list of constructed objects
+    byte_t* raw;              // Objects left unconstructed by a failure
+    byte_t* bump;             // Next never-used object in the newest slab
+    byte_t* bump_end;         // End of the newest slab
+    slab_t* slabs;            // Every slab of the pool
+    mlock_ctor_fn ctor;       // Constructor, or NULL
+    mlock_dtor_fn dtor;       // Destructor, or NULL
+    void* arg;                // Argument passed to the constructor/destructor
+    word_t id;                // Unique id of the pool, or 0 once destroyed
+    struct mlock_pool* next;  // Next live pool, or next one ready for reuse
+};
+
+/**
+ * A pool of page-aligned I/O buffers in a segment of their own, locked in
+ * memory.  Free buffers are a lock-free stack linked through their first
+ * word.
+ */
+struct mlock_iobufs {
+    span_t span;                // The buffers' pages, owned by the pool
+    size_t buffer_size;         // Bytes of each buffer, in whole pages
+    unsigned count;             // Number of buffers
+    uint64_t top;               // First free buffer and a version
+    struct iovec* iovecs;       // Every buffer, in order
+    struct mlock_iobufs* next;  // Next pool ready for reuse
+};
+
+/**
+ * Objects of one pool cached by a thread.
+ */
+typedef struct {
+    mlock_pool_t* pool;  // Pool the objects belong to
+    word_t id;           // Id of the pool when the objects were cached
+    byte_t* head;        // First cached object, linked through the objects
+    unsigned count;      // Number of cached objects
+} pool_cache_t;
+
+/**
+ * A lock around the heap's short critical sections, which spins for a while
+ * before sleeping.  Zero is unlocked.
+ */
+typedef struct {
+    int state;  // One of the LOCK_ constants
+} heap_lock_t;
+
+/**
+ * Blocks of one size class cached by a thread, still marked allocated.
+ */
+typedef struct {
+    byte_t* head;        // First cached block, linked through its first word
+    unsigned count;      // Number of cached blocks
+    unsigned limit;      // Blocks cached before some are flushed
+    unsigned misses;     // Allocations that found none since the last resize
+    unsigned overflows;  // Frees that passed the limit since the last resize
+} cache_class_t;
+
+/**
+ * A block whose lifetime is being measured.
+ */
+typedef struct {
+    byte_t* bp;    // Pointer to the start of the block's data, or NULL
+    site_t* site;  // Site the block was allocated from
+    word_t birth;  // Allocation clock when the block was allocated
+} tracked_t;
+
+/**
+ * A tag's soft limit with its callback.
+ */
+typedef struct {
+    size_t bytes;       // The limit in bytes
+    mlock_limit_fn fn;  // Callback to run when the limit is crossed, or NULL
+    void* arg;          // Argument passed to the callback
+} tag_limit_t;
+
 // ---[ CONSTANTS ]------------------------------------------------------------
 
 #ifdef MLOCK_WORD_SIZE
@@ -44,12 +198,96 @@ typedef char byte_t;    // A byte; 8 bits
 
 #define FREE      0  // The block is free
 #define ALLOCATED 1  // The block is allocated
+#define SAMPLED   2  // The allocated block was reported to the hooks
+#define TRACKED   4  // The allocated block's lifetime is being measured
+
+#define CHUNK_SIZE    (1 << 12)  // Default initial heap size in bytes
+#define HEADER_SIZE   WORD_SIZE  // Header size in bytes
+#define BOUNDARY_SIZE WORD_SIZE  // Boundary tag size in bytes
+
+#ifdef MLOCK_ENABLE_FREE_INDEX
+#define MIN_DATA_SIZE ALIGN_BYTES(WORD_SIZE * 3)  // Min size of block data
+#else
+#define MIN_DATA_SIZE (WORD_SIZE * 2)  // Min size of block data in bytes
+#endif
+
+#define MIN_BLOCK_SIZE (MIN_DATA_SIZE + HEADER_SIZE + BOUNDARY_SIZE)
+
+#define PAGE_SHIFT 12                // Log base 2 of the page size
+#define PAGE_SIZE  (1 << PAGE_SHIFT)  // Page size in bytes
+#define META_CHUNK (1 << 16)          // Bytes mapped at once for metadata
+
+#define SPAN_HEAP  1  // The span is a boundary-tagged heap segment
+#define SPAN_SLAB  2  // The span is a slab of pool objects
+#define SPAN_IOBUF 3  // The span is a segment of pinned I/O buffers
+#define SPAN_RING  4  // The span is a ring's pages, mapped twice
+
+#define NUM_HEAPS    2          // Number of heaps, one per lifetime hint
+#define ARENAS_PER_CPU 4        // Default arenas for each online CPU
+#define SEGMENT_SIZE (1 << 20)  // Minimum bytes mapped for a heap segment
+
+#define COLOR_STEP 64  // Bytes between the starts of differently colored data
+
+#define FAST_SCAN 8  // Blocks of a bin searched without the arena lock
+#define NEAR_SCAN 8  // Blocks searched on each side of a hint, and per bin
+
+#define LOCK_FREE    0   // A heap lock nobody holds
+#define LOCK_HELD    1   // A heap lock held with no thread asleep on it
+#define LOCK_WAITED  2   // A heap lock that threads may be asleep on
+#define LOCK_SPINS   32  // Tries at a held heap lock before sleeping on it
+#define LOCK_BACKOFF 64  // Most pauses between tries at a heap lock
+
+#define PURGE_MIN   (PAGE_SIZE * 2)  // Smallest free block that gets purged
+#define PURGE_TICKS 1024             // Allocator calls between purge checks
+
+#define SLAB_SIZE      (1 << 16)  // Minimum bytes of objects in a pool slab
+#define SLAB_OBJECTS   8          // Minimum objects in a pool slab
+#define POOL_CACHES    16         // Pools each thread caches objects of
+#define POOL_CACHE_MAX 64         // Objects a thread caches per pool
+#define POOL_BATCH     32         // Objects moved at once to or from a pool
+
+#define CACHE_MAX_SIZE  512        // Bytes of data of the largest cached block
+#define CACHE_CLASSES   (CACHE_MAX_SIZE / 8 + 1)  // Classes 8 bytes apart
+#define CACHE_MIN_LIMIT 2          // Fewest blocks a class caches
+#define CACHE_START     8          // Blocks a class caches at first
+#define CACHE_MAX_LIMIT 256        // Most blocks a class caches
+#define CACHE_MAX_BYTES (1 << 15)  // Most bytes of blocks a class caches
+#define CACHE_ADAPT     8          // Misses and overflows between resizes
+#define TRANSFER_SLOTS  8          // Batches an arena holds per size class
+
+#define EPOCH_BAG_SIZE 60  // Deferred blocks held by one bag
+#define EPOCH_INTERVAL 64  // Blocks deferred between tries to advance epochs
+
+#define THREAD_UNUSED 0  // The thread hasn't used the structure yet
+#define THREAD_LIVE   1  // The structure is in its list of live ones
+#define THREAD_DEAD   2  // The thread is exiting, so it's bypassed
+
+#define SITE_COUNT     1024  // Allocation sites whose lifetimes are learned
+#define TRACK_COUNT    256   // Blocks whose lifetimes are measured at once
+#define TRACK_INTERVAL 16    // Allocations per block measured
+#define SCORE_SHORT    8     // Site score from which blocks are short-lived
+#define SCORE_MAX      16    // Highest site score
+#define HINT_NONE      -1    // No hint given with the allocation itself
+
+#define TAG_SIZE  ALIGN_BYTES(WORD_SIZE)  // Bytes before a tagged pointer
+#define TAG_BATCH (1 << 16)  // Bytes a thread counts before publishing
+
+// Bits of a virtual address; pointers past them are never in the page map
+#define ADDRESS_BITS (sizeof(void*) == 8 ? 48 : 32)
+
+#define PAGEMAP_BITS      (ADDRESS_BITS - PAGE_SHIFT)  // Bits of a page number
+#define PAGEMAP_LEAF_BITS (PAGEMAP_BITS / 3)  // Page number bits for a leaf
+#define PAGEMAP_MID_BITS  (PAGEMAP_BITS / 3)  // Page number bits for a node
+#define PAGEMAP_ROOT_BITS                                                     \
+    (PAGEMAP_BITS - PAGEMAP_LEAF_BITS - PAGEMAP_MID_BITS)  // Root bits
+
+#define NUM_BINS 64  // Number of power-of-two size bins
 
-#define MIN_DATA_SIZE  (WORD_SIZE * 2)  // Min size of block data in bytes
-#define MIN_BLOCK_SIZE (WORD_SIZE * 4)  // Min size of a total block in bytes
-#define CHUNK_SIZE     (1 << 12)        // Initial heap size in bytes
-#define HEADER_SIZE    WORD_SIZE        // Header size in bytes
-#define BOUNDARY_SIZE  WORD_SIZE        // Boundary tag size in bytes
+#ifdef MLOCK_ENABLE_FREE_INDEX
+#define INDEX_LANES    8           // Sizes compared per vector instruction
+#define INDEX_CAPACITY 64          // Initial entries per index bin
+#define NOT_INDEXED    ((word_t)-1)  // Slot of a block missing from the index
+#endif
 
 // ---[ MACROS ]---------------------------------------------------------------
 
@@ -58,6 +296,23 @@ typedef char byte_t;    // A byte; 8 bits
  */
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+/**
+ * @returns The smaller of x and y.
+ */
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/**
+ * Tells the CPU it's in a spin loop, so it can save power and let a sibling
+ * hyperthread run.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
 /**
  * @param size The aligned size of the block's data in bytes.
  * @param alloc 1 if the block is allocated, else 0.
@@ -66,17 +321,19 @@ typedef char byte_t;    // A byte; 8 bits
 #define PACK_HEADER(size, alloc) ((word_t)(size) | (word_t)(alloc))
 
 /**
+ * Words are read and written whole, as a block's header may be read by a
+ * thread coalescing next to it while another claims it under its bin's lock.
  * @param p Pointer to a word.
  * @returns The value at p.
  */
-#define GET_WORD(p) (*(word_t*)(p))
+#define GET_WORD(p) __atomic_load_n((word_t*)(p), __ATOMIC_RELAXED)
 
 /**
  * @param p Pointer to a word.
  * @param val The value to put at p.
- * @returns val.
  */
-#define PUT_WORD(p, val) (GET_WORD(p) = (val))
+#define PUT_WORD(p, val)                                                      \
+    __atomic_store_n((word_t*)(p), (word_t)(val), __ATOMIC_RELAXED)
 
 /**
  * @param p Pointer to a header/boundary tag.
@@ -178,6 +435,42 @@ typedef char byte_t;    // A byte; 8 bits
  */
 #define PUT_PREV_FREE(fp, val) PUT_WORD((word_t*)(fp) + 1, (word_t)(val))
 
+/**
+ * @param bp Pointer to the first block of a batch of cached blocks.
+ * @returns Pointer to the first block of the next batch on the stack.
+ */
+#define GET_NEXT_BATCH(bp) (byte_t*)GET_WORD((word_t*)(bp) + 1)
+
+/**
+ * @param bp Pointer to the first block of a batch of cached blocks.
+ * @param val The value to put as the pointer to the next batch.
+ */
+#define PUT_NEXT_BATCH(bp, val) PUT_WORD((word_t*)(bp) + 1, (word_t)(val))
+
+/**
+ * Packs the top of a lock-free stack.  The version goes up with every change,
+ * so a thread whose top was popped and pushed back meanwhile fails its
+ * compare-and-swap instead of linking in a stale next pointer.
+ * @param bp Pointer to the top block, or NULL.
+ * @param version The stack's version, wrapping in the bits above a pointer.
+ * @returns The packed top.
+ */
+#define PACK_STACK(bp, version)                                               \
+    ((uint64_t)(uintptr_t)(bp) | (uint64_t)(version) << ADDRESS_BITS)
+
+/**
+ * @param top The packed top of a lock-free stack.
+ * @returns Pointer to the top block, or NULL.
+ */
+#define STACK_TOP(top)                                                        \
+    ((byte_t*)(uintptr_t)((top) & (((uint64_t)1 << ADDRESS_BITS) - 1)))
+
+/**
+ * @param top The packed top of a lock-free stack.
+ * @returns The stack's version.
+ */
+#define STACK_VERSION(top) ((top) >> ADDRESS_BITS)
+
 /**
  * @param bytes The original number of bytes.
  * @returns The adjusted number of bytes that is aligned.
@@ -214,276 +507,4400 @@ typedef char byte_t;    // A byte; 8 bits
         }                                                                     \
     } while (0);
 
-// ---[ GLOBALS ]--------------------------------------------------------------
+/**
+ * @param size The aligned size of a block's data in bytes.
+ * @returns The index of the power-of-two bin the size belongs to.
+ */
+#define SIZE_BIN(size)                                                        \
+    ((int)(sizeof(unsigned long) * 8 - 1                                     \
+        - __builtin_clzl((unsigned long)((size) >> 3))))
 
 /**
- * Pointer to the data of the first block of the free list
+ * @param used Bitmap of non-empty bins.
+ * @param bin A bin index.
+ * @returns The bits of used for bins larger than bin.
  */
-static byte_t* free_list = NULL;
+#define LARGER_BINS(used, bin)                                                \
+    ((bin) + 1 < NUM_BINS ? (used) & ~((2ULL << (bin)) - 1) : 0)
 
-// ---[ HELPER FUNCTION PROTOTYPES ]-------------------------------------------
+#ifdef MLOCK_ENABLE_FREE_INDEX
+/**
+ * @param size The aligned size of a block's data in bytes.
+ * @returns The size in eight-byte granules, clamped to 32 bits.
+ */
+#define GET_GRANULES(size)                                                    \
+    ((size) >> 3 > UINT32_MAX ? UINT32_MAX : (uint32_t)((size) >> 3))
 
 /**
- * Removes a free block from the free list and adjusts its neighbor's next and
- * prev pointers.
- * @param fp Pointer to the start of a free block's data.
+ * @param size The indexed size of a candidate block.
+ * @param fp Pointer to the start of the candidate block's data.
+ * @param best_size The indexed size of the best block so far.
+ * @param best Pointer to the start of the best block's data so far.
+ * @returns Whether the candidate is preferred under the fit and order
+ * policies.
  */
-static void remove_free_block(byte_t* fp);
+#define INDEX_BETTER(size, fp, best_size, best)                               \
+    (options.fit_policy == MLOCK_FIT_BEST && (size) != (best_size)            \
+            ? (size) < (best_size)                                            \
+            : options.order_policy == MLOCK_ORDER_ADDRESS && (fp) < (best))
 
 /**
- * Extends the heap with a new free block and inserts it into the free list.
- * @param size The number of bytes that need to be in the block's data.
- * @returns 0 on success, -1 on failure.
+ * @param fp Pointer to the start of a free block's data.
+ * @returns The block's slot in its index bin.
  */
-static int extend_heap(size_t size);
+#define GET_FREE_SLOT(fp) GET_WORD((word_t*)(fp) + 2)
 
 /**
- * Place an allocated block of at least the given size at the given free block.
- * Properly re-points the free list and adjusts the given size to abide by the
- * byte alignment and minimum block size.
  * @param fp Pointer to the start of a free block's data.
- * @param size The size of the block that must be allocated.
+ * @param val The block's slot in its index bin.
+ * @returns val.
  */
-static void place(byte_t* fp, word_t size);
+#define PUT_FREE_SLOT(fp, val) PUT_WORD((word_t*)(fp) + 2, (word_t)(val))
+#endif
 
 /**
- * Finds a free block that can fit an allocated block of the given size.
- * @param size The size of the block's data in bytes that must be allocated.
- * @returns Pointer to the start of a free block's data, if one exists of the
- * needed size.  Else returns null.
+ * @param fp Pointer to the start of a free block of at least `PURGE_MIN`
+ * bytes.
+ * @returns When the block became free in milliseconds, or 0 if its pages were
+ * already purged.
  */
-static byte_t* find_fit(word_t size);
+#define GET_FREED_AT(fp) GET_WORD((word_t*)(fp) + 3)
 
-// ---[ FUNCTION DEFINITIONS ]-------------------------------------------------
+/**
+ * @param fp Pointer to the start of a free block of at least `PURGE_MIN`
+ * bytes.
+ * @param val When the block became free in milliseconds, or 0 once purged.
+ * @returns val.
+ */
+#define PUT_FREED_AT(fp, val) PUT_WORD((word_t*)(fp) + 3, (word_t)(val))
 
-void* init_lock(void)
-{
-    DEBUG("Initializing memory");
+/**
+ * @param bp Pointer to the start of an allocated block's data.
+ * @returns Whether or not the block was reported to the hooks.
+ */
+#define IS_SAMPLED(bp) (GET_WORD(GET_HEADER(bp)) & SAMPLED)
 
-    // Allocate initial heap
-    word_t* heap_list = sbrk(WORD_SIZE * 4);
-    word_t* heap_start = heap_list + 2;
+/**
+ * Marks the given block as reported to the hooks.  Only the header carries
+ * the mark, and redoing the headers clears it.
+ * @param bp Pointer to the start of an allocated block's data.
+ */
+#define MARK_SAMPLED(bp)                                                      \
+    PUT_WORD(GET_HEADER(bp), GET_WORD(GET_HEADER(bp)) | SAMPLED)
 
-    if (heap_list == NULL) {
-        DEBUG("Failed initial sbrk");
-        return NULL;
-    }
+/**
+ * @param bp Pointer to the start of an allocated block's data.
+ * @returns Whether or not the block's lifetime is being measured.
+ */
+#define IS_TRACKED(bp) (GET_WORD(GET_HEADER(bp)) & TRACKED)
 
-    PUT_WORD(heap_list++, 0x00DECADE);
-    PUT_WORD(heap_list++, PACK_HEADER(0, ALLOCATED));  // Prologue header
-    PUT_WORD(heap_list++, PACK_HEADER(0, ALLOCATED));  // Prologue boundary tag
-    PUT_WORD(heap_list++, PACK_HEADER(0, ALLOCATED));  // Epilogue header
+/**
+ * Marks the given block as having its lifetime measured.  Only the header
+ * carries the mark, and redoing the headers clears it.
+ * @param bp Pointer to the start of an allocated block's data.
+ */
+#define MARK_TRACKED(bp)                                                      \
+    PUT_WORD(GET_HEADER(bp), GET_WORD(GET_HEADER(bp)) | TRACKED)
 
-    // extend_heap inserts the free block into free_list
-    if (extend_heap(CHUNK_SIZE) == -1) {
-        DEBUG("Failed to create the first free block");
-        return NULL;
-    }
+/**
+ * @param pool A pool.
+ * @param obj Pointer to a free object of the pool.
+ * @returns Pointer to the next free object in the same list.
+ */
+#define GET_POOL_NEXT(pool, obj)                                              \
+    (byte_t*)GET_WORD((byte_t*)(obj) + (pool)->link_offset)
 
-    DEBUG("Finished initializing memory");
-    return (void*)heap_start;
-}
+/**
+ * @param pool A pool.
+ * @param obj Pointer to a free object of the pool.
+ * @param val Pointer to the next free object in the same list.
+ * @returns val.
+ */
+#define PUT_POOL_NEXT(pool, obj, val)                                         \
+    PUT_WORD((byte_t*)(obj) + (pool)->link_offset, (word_t)(val))
 
-void* mlock(size_t size)
-{
-    DEBUG("Starting malloc of size %ld", size);
+/**
+ * @param obj Pointer to a pool object.
+ * @returns The slab the object belongs to.
+ */
+#define GET_SLAB(obj) ((slab_t*)pagemap_get(obj))
 
-    if (size <= 0) {
-        DEBUG("Can't malloc of size %ld", size);
-        return NULL;
-    }
+/**
+ * @param p Any pointer.
+ * @param count A power of two.
+ * @returns A hash of the pointer below count.
+ */
+#define HASH_PTR(p, count)                                                    \
+    (((word_t)(p) >> 3) * 2654435761u >> 16 & ((count) - 1))
 
-    size = ALIGN_BYTES(size);
-    size = MAX(size, MIN_DATA_SIZE);
-    byte_t* fp = find_fit(size);
+/**
+ * @param tag An allocation tag.
+ * @returns The tag word stored just before a tagged pointer.  Its allocated
+ * bit is clear, which tells it apart from the header of an untagged block.
+ */
+#define PACK_TAG(tag) ((word_t)(tag) << 3)
 
-    if (fp != NULL) {
-        place(fp, size);
-        DEBUG("Placed block at %p", fp);
-        return fp;
-    }
+/**
+ * @param ptr A pointer returned by mlock.
+ * @returns Whether or not the pointer is tagged.
+ */
+#define IS_TAGGED(ptr) ((GET_WORD((byte_t*)(ptr) - WORD_SIZE) & 0x1) == 0)
 
-    // No available blocks; extend heap to get more
-    if (extend_heap(MAX(size, CHUNK_SIZE)) == -1) {
-        DEBUG("Failed to extend memory by %ld bytes", size);
-        return NULL;
-    }
+/**
+ * @param ptr A tagged pointer returned by mlock.
+ * @returns The pointer's tag.
+ */
+#define GET_TAG(ptr) ((int)(GET_WORD((byte_t*)(ptr) - WORD_SIZE) >> 3))
 
-    // extend_heap put the result in free_list
-    fp = free_list;
+/**
+ * @param p Any pointer.
+ * @returns The number of the page p is in.
+ */
+#define GET_PAGE(p) ((word_t)(p) >> PAGE_SHIFT)
 
-    place(fp, size);
-    DEBUG("Malloc-ed extended block of size %ld at pointer %p", size, fp);
-    return fp;
-}
+/**
+ * @param bytes The original number of bytes.
+ * @returns The adjusted number of bytes that is a whole number of pages.
+ */
+#define ALIGN_PAGES(bytes)                                                    \
+    (((bytes) + PAGE_SIZE - 1) & ~(word_t)(PAGE_SIZE - 1))
 
-void unlock(void* ptr)
-{
-    DEBUG("Freeing pointer %p", ptr);
+/**
+ * @param fp Pointer to the start of a free block's data.
+ * @returns Whether the block is the only one between a prologue and an
+ * epilogue, i.e. its whole segment is free.
+ */
+#define IS_DRAINED(fp)                                                        \
+    (GET_WORD(GET_PREV_BOUNDARY(fp)) == PACK_HEADER(0, ALLOCATED)             \
+        && GET_WORD(GET_NEXT_HEADER(fp)) == PACK_HEADER(0, ALLOCATED))
 
-    word_t size = GET_SIZE(ptr);
-    REDO_HEADERS(ptr, size, FREE);
+// ---[ GLOBALS ]--------------------------------------------------------------
 
-    if (GET_PREV_ALLOC(ptr) == FREE) {
-        // Coalesce with previous
-        DEBUG("Coalescing with prev");
-        ptr = GET_PREV_BLOCK(ptr);
-        DEBUG("Prev pointer %p", ptr);
-        size += GET_SIZE(ptr) + BOUNDARY_SIZE + HEADER_SIZE;
-        REDO_HEADERS(ptr, size, FREE);
-        remove_free_block(ptr);
-    }
+/**
+ * Descriptor of the span grown with sbrk at the start of the long-lived heap.
+ * NULL until the heap is initialized.
+ */
+static span_t* heap_span = NULL;
 
-    byte_t* next_header = GET_NEXT_HEADER(ptr);
+/**
+ * Span descriptors of released segments, linked through their owner, ready to
+ * be reused.
+ */
+static span_t* free_spans = NULL;
 
-    if (GET_ALLOC_FROM_HEADER(next_header) == FREE) {
-        // Coalesce with next
-        DEBUG("Coalescing with next");
-        DEBUG("Next header %p", next_header);
-        size
-            += GET_SIZE_FROM_HEADER(next_header) + BOUNDARY_SIZE + HEADER_SIZE;
-        REDO_HEADERS(ptr, size, FREE);
-        remove_free_block(next_header + HEADER_SIZE);
-    }
+/**
+ * Guards the page map, allocator metadata and the tables every arena shares.
+ * May be taken while holding an arena's lock, but not the other way around.
+ * Recursive, so destructors run while reaping may allocate and free.
+ */
+static pthread_mutex_t meta_lock;
+static pthread_once_t meta_lock_once = PTHREAD_ONCE_INIT;
 
-    // Insert ptr before the current free list head
-    LINK_FREE(ptr, free_list);
-    PUT_PREV_FREE(ptr, NULL);
-    free_list = ptr;
+/**
+ * Slab descriptors and pools of objects and buffers that were released, ready
+ * to be reused.
+ */
+static slab_t* free_slabs = NULL;
+static mlock_pool_t* free_pools = NULL;
+static mlock_iobufs_t* free_iobufs = NULL;
 
-    DEBUG("Finished freeing pointer %p", ptr);
-}
+/**
+ * Every pool that hasn't been destroyed, so they can be reaped under
+ * pressure.
+ */
+static mlock_pool_t* live_pools = NULL;
 
-void* relock(void* ptr, size_t size)
-{
-    DEBUG("Reallocating pointer %p to size %ld", ptr, size);
+/**
+ * Id the last pool was created with.
+ */
+static word_t last_pool_id = 0;
 
-    if (ptr == NULL) {
-        DEBUG("Making new pointer");
-        return mlock(size);
-    }
+/**
+ * Objects this thread caches from pools, indexed by pool id.
+ */
+static _Thread_local pool_cache_t pool_caches[POOL_CACHES];
 
-    if (size <= 0) {
-        DEBUG("Freeing pointer %p", ptr);
-        unlock(ptr);
-        return NULL;
-    }
+/**
+ * A thread's cache of small blocks from long-lived heaps.  Scavengers take
+ * its lock to empty it once the thread has gone idle.
+ */
+typedef struct thread_cache {
+    cache_class_t classes[CACHE_CLASSES];
+    pthread_mutex_t lock;       // Held by the thread while using the cache
+    unsigned ticks;             // Times the thread has used the cache
+    unsigned seen_ticks;        // Ticks when scavenging last looked
+    word_t idle_since;          // When scavenging saw the ticks change
+    int state;                  // One of the THREAD_ constants
+    struct thread_cache* next;  // Next cache of a live thread
+    struct thread_cache* prev;  // Previous cache of a live thread
+} thread_cache_t;
 
-    size = ALIGN_BYTES(size);
-    size = MAX(size, MIN_DATA_SIZE);
-    word_t current_size = GET_SIZE(ptr);
+/**
+ * This thread's cache of small blocks.
+ */
+static _Thread_local thread_cache_t thread_cache;
 
-    if (size == current_size) {
-        DEBUG("No change needed");
-        return ptr;
-    }
+/**
+ * Caches of threads that haven't exited, so idle ones can be scavenged.
+ */
+static thread_cache_t* live_caches = NULL;
 
-    if (size < current_size) {
-        size_t leftover = current_size - size;
+/**
+ * A bag of blocks passed to unlock_deferred in one epoch, waiting for every
+ * thread that could still be reading them to leave its critical section.
+ */
+typedef struct bag {
+    struct bag* next;            // Next bag, of the same epoch for a thread
+    word_t epoch;                // Epoch the blocks were deferred in
+    unsigned count;              // Number of blocks held
+    void* ptrs[EPOCH_BAG_SIZE];  // The blocks, as passed to unlock_deferred
+} bag_t;
 
-        if (leftover < MIN_BLOCK_SIZE) {
-            // Not enough leftovers to make a new free block
-            DEBUG("Too few leftovers, no change needed");
-            return ptr;
-        }
+/**
+ * A thread's part in epoch-based reclamation.
+ */
+typedef struct epoch_record {
+    bag_t* limbo[3];            // Bags of deferred blocks by epoch mod 3
+    word_t pinned;              // Epoch entered, shifted left by one, with
+                                // bit 0 set while in a critical section
+    unsigned depth;             // Critical sections entered and not left
+    unsigned deferred;          // Blocks deferred, pacing epoch advances
+    word_t seen;                // Epoch when expired bags were last freed
+    int state;                  // One of the THREAD_ constants
+    struct epoch_record* next;  // Next record of a live thread
+    struct epoch_record* prev;  // Previous record of a live thread
+} epoch_record_t;
 
-        // Create new free block from leftovers
-        REDO_HEADERS(ptr, size, ALLOCATED);
-        byte_t* new_fp = GET_NEXT_BLOCK(ptr);
-        REDO_HEADERS(new_fp, leftover - HEADER_SIZE - BOUNDARY_SIZE, FREE);
-        unlock(new_fp);
+/**
+ * The global epoch.  It advances once every thread in a critical section has
+ * entered it, so blocks deferred two epochs ago can't be seen by anyone.
+ */
+static word_t global_epoch = 0;
 
-        DEBUG("Shrunk and created new free block");
+/**
+ * This thread's epoch record.
+ */
+static _Thread_local epoch_record_t epoch_record;
+
+/**
+ * Epoch records of threads that haven't exited.
+ */
+static epoch_record_t* live_records = NULL;
+
+/**
+ * Bags left by exited threads, still waiting for their epochs to expire, and
+ * empty bags ready to be reused.
+ */
+static bag_t* orphan_bags = NULL;
+static bag_t* free_bags = NULL;
+
+/**
+ * Options the heap was initialized with.
+ */
+static mlock_options_t options;
+
+/**
+ * Bottom level of the page map, holding the span of each page.
+ */
+typedef struct {
+    span_t* spans[1 << PAGEMAP_LEAF_BITS];
+} pagemap_leaf_t;
+
+/**
+ * Middle level of the page map.
+ */
+typedef struct {
+    pagemap_leaf_t* leaves[1 << PAGEMAP_MID_BITS];
+} pagemap_node_t;
+
+/**
+ * Three-level radix tree from page number to the span that page belongs to.
+ * Lower levels are only mapped once a span reaches them.
+ */
+static pagemap_node_t* pagemap[1 << PAGEMAP_ROOT_BITS];
+
+/**
+ * Live bytes and blocks of each tag, published by threads in batches.
+ */
+static long tag_bytes[MLOCK_MAX_TAGS];
+static long tag_count[MLOCK_MAX_TAGS];
+
+/**
+ * Soft limit of each tag with its callback, or NULL if unset.  Like the
+ * hooks, each limit set publishes a fresh copy that is never changed or
+ * freed.
+ */
+static const tag_limit_t* tag_limits[MLOCK_MAX_TAGS];
+
+/**
+ * Set while a tag is over its soft limit, so the callback fires once per
+ * crossing.
+ */
+static int tag_over_limit[MLOCK_MAX_TAGS];
+
+/**
+ * Live bytes and blocks of each tag this thread hasn't published yet.
+ */
+static _Thread_local long thread_tag_bytes[MLOCK_MAX_TAGS];
+static _Thread_local long thread_tag_count[MLOCK_MAX_TAGS];
+
+/**
+ * Tag given to this thread's allocations made through mlock.
+ */
+static _Thread_local int thread_tag = 0;
+
+/**
+ * Set once this thread has registered to publish its counts on exit.
+ */
+static _Thread_local int thread_registered = 0;
+
+/**
+ * Key whose destructor publishes a thread's counts when it exits.
+ */
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Allocator calls counted so far; every `PURGE_TICKS`th checks for idle free
+ * memory.
+ */
+static unsigned purge_ticks = 0;
+
+/**
+ * When idle free memory was last checked for, in milliseconds.
+ */
+static word_t last_purge = 0;
+
+/**
+ * When thread caches were last checked for idleness, in milliseconds.
+ */
+static word_t last_scavenge = 0;
+
+/**
+ * Limits on the bytes the heap takes from the system.  A limit of zero is
+ * unset.
+ */
+static size_t soft_limit = 0;
+static size_t hard_limit = 0;
+
+/**
+ * Registered reclaim callbacks, run in order when the heap would grow past its
+ * soft limit.
+ */
+static mlock_reclaim_fn reclaim_fns[MLOCK_MAX_RECLAIMS];
+static void* reclaim_args[MLOCK_MAX_RECLAIMS];
+static int reclaim_count = 0;
+
+/**
+ * Set while reclaiming, so allocations made by reclaim callbacks don't start
+ * another round.
+ */
+static _Thread_local int in_reclaim = 0;
+
+/**
+ * Color the next large allocation will be offset by.
+ */
+static unsigned next_color = 0;
+
+/**
+ * Registered allocation event hooks, or NULL if none are.  Each registration
+ * publishes a fresh copy that is never changed or freed, so a thread that
+ * loaded it can call through it while another registers new ones.
+ */
+static const mlock_hooks_t* hooks = NULL;
+
+/**
+ * Bytes this thread may still allocate before the next sampled allocation.
+ */
+static _Thread_local long sample_countdown = 0;
+
+/**
+ * State of this thread's sampling jitter.
+ */
+static _Thread_local unsigned sample_seed = 0;
+
+/**
+ * Set while this thread runs a hook, so allocations made by hooks aren't
+ * reported back to them.
+ */
+static _Thread_local int in_hook = 0;
+
+/**
+ * Next free byte and end of the current metadata chunk.
+ */
+static byte_t* meta_next = NULL;
+static byte_t* meta_end = NULL;
+
+#ifdef MLOCK_ENABLE_FREE_INDEX
+/**
+ * A vector of eight block sizes in granules.
+ */
+typedef uint32_t granule_vec_t
+    __attribute__((vector_size(INDEX_LANES * sizeof(uint32_t))));
+
+/**
+ * One size bin of the free-block index.  The sizes and blocks arrays are
+ * parallel, so a fit search streams through sizes alone without touching the
+ * blocks themselves.  Unused slots of sizes are kept at zero so whole vectors
+ * can be compared past the last entry.
+ */
+typedef struct {
+    uint32_t* sizes;  // Block sizes in granules
+    byte_t** blocks;  // Pointers to the start of each block's data
+    size_t count;     // Number of entries in use
+    size_t capacity;  // Number of entries allocated, a multiple of the lanes
+} index_bin_t;
+
+#endif
+
+/**
+ * A heap: one or more segments of boundary-tagged blocks sharing free lists.
+ * Blocks never coalesce across segments, as each segment ends in its own
+ * prologue and epilogue.
+ */
+typedef struct {
+    byte_t* free_lists[NUM_BINS];  // First free block of each bin's list
+    unsigned long long bins_used;  // Bit n is set if list n is non-empty
+#ifdef MLOCK_ENABLE_FREE_INDEX
+    index_bin_t free_index[NUM_BINS];    // Index of every free block
+    unsigned long long index_bins_used;  // Bit n is set if bin n is non-empty
+#endif
+    heap_lock_t bin_locks[NUM_BINS];  // Guards each bin's free list
+    struct arena* arena;  // Arena the heap belongs to
+    span_t* top;          // Segment grown in place with sbrk, or NULL
+    size_t size;          // Bytes of all the heap's segments
+    int release;          // Return drained segments to the system if set
+} heap_t;
+
+/**
+ * Batches of cached blocks of one size class that thread caches hand each
+ * other through an arena.  Each batch is a chain linked through the blocks'
+ * first words, and the batches form a lock-free stack linked through the
+ * second word of their first blocks.
+ */
+typedef struct {
+    uint64_t top;      // First batch and a version, packed by PACK_STACK
+    unsigned batches;  // Number of batches held, or about to be
+    int touched;       // Set when a batch moves, cleared by scavenging
+} transfer_t;
+
+/**
+ * An arena: a heap per lifetime hint, behind a lock of its own.  Long-lived
+ * and unhinted blocks share the long-lived heap; short-lived blocks get mapped
+ * segments of their own, which are released once they drain.
+ */
+typedef struct arena {
+    heap_t heaps[NUM_HEAPS];  // The arena's heaps, indexed by lifetime hint
+    heap_lock_t lock;         // Guards growing, coalescing and splitting
+    byte_t* remote;           // Blocks freed while another arena was locked
+    int ready;                // Set once the arena's locks are initialized
+    transfer_t transfers[CACHE_CLASSES];  // Batches of each cache class
+} arena_t;
+
+/**
+ * The arenas.  Only the first arena's long-lived heap grows with sbrk.
+ */
+static arena_t arenas[MLOCK_MAX_ARENAS];
+
+/**
+ * Number of arenas threads are spread over, and the next one to be given out.
+ */
+static unsigned arena_count = 0;
+static unsigned next_arena = 0;
+
+/**
+ * Tries at a held heap lock before sleeping on it.  Zero until the heap is
+ * initialized, and on machines with a single CPU.
+ */
+static int lock_spins = 0;
+
+/**
+ * Times heap locks were found held, taken after spinning, and slept on.
+ */
+static size_t lock_contended = 0;
+static size_t lock_spun = 0;
+static size_t lock_parked = 0;
+
+/**
+ * Arena this thread allocates from, or NULL until its first allocation.
+ */
+static _Thread_local arena_t* thread_arena = NULL;
+
+/**
+ * Arena whose lock this thread holds, and how many times it took the lock.
+ */
+static _Thread_local arena_t* locked_arena = NULL;
+static _Thread_local int locked_depth = 0;
+
+/**
+ * Lifetime hint given to this thread's allocations.
+ */
+static _Thread_local int thread_hint = MLOCK_HINT_LONG;
+
+/**
+ * Learned lifetimes of allocation sites, indexed by a hash of the site.
+ */
+static site_t sites[SITE_COUNT];
+
+/**
+ * Blocks whose lifetimes are being measured, indexed by a hash of the block.
+ */
+static tracked_t tracked[TRACK_COUNT];
+
+/**
+ * Bytes allocated so far while predicting lifetimes; lifetimes are measured
+ * against it.
+ */
+static word_t alloc_clock = 0;
+
+/**
+ * Allocations counted so far while predicting lifetimes; every
+ * `TRACK_INTERVAL`th has its lifetime measured.
+ */
+static unsigned track_ticks = 0;
+
+// ---[ HELPER FUNCTION PROTOTYPES ]-------------------------------------------
+
+/**
+ * Initializes the heap with the given options, with the global lock held.
+ * @param opts The options, or NULL for the defaults.
+ * @returns Pointer to the start of the heap on a success, else NULL.
+ */
+static void* init_heap(const mlock_options_t* opts);
+
+/**
+ * Takes a heap lock, spinning with backoff while its holder is likely to let
+ * go soon, then sleeping until it does.
+ * @param lock The lock.
+ */
+static void heap_lock(heap_lock_t* lock);
+
+/**
+ * Releases a heap lock, waking a thread asleep on it.
+ * @param lock The lock.
+ */
+static void heap_unlock(heap_lock_t* lock);
+
+/**
+ * Takes the global lock, creating it on first use.
+ */
+static void lock_meta(void);
+
+/**
+ * Releases the global lock.
+ */
+static void unlock_meta(void);
+
+/**
+ * Creates the recursive global lock.
+ */
+static void make_meta_lock(void);
+
+/**
+ * Sets up the given arena's heaps, with the global lock held.
+ * @param arena The arena.
+ */
+static void ready_arena(arena_t* arena);
+
+/**
+ * Picks the arena this thread allocates from, initializing the heap and
+ * giving the thread an arena on its first allocation.  While the thread holds
+ * an arena's lock, its allocations come from that arena.
+ * @returns The arena, else NULL if the heap failed to initialize.
+ */
+static arena_t* pick_arena(void);
+
+/**
+ * Takes the given arena's lock, then frees the blocks other threads left on
+ * its remote list.  The thread must hold no other arena's lock.
+ * @param arena The arena.
+ */
+static void lock_arena(arena_t* arena);
+
+/**
+ * Releases the given arena's lock.
+ * @param arena The arena.
+ */
+static void unlock_arena(arena_t* arena);
+
+/**
+ * Frees an allocated block back to its heap, or leaves it on the arena's
+ * remote list if this thread holds another arena's lock.
+ * @param heap The heap the block belongs to.
+ * @param bp Pointer to the start of the block's data.
+ */
+static void free_to_arena(heap_t* heap, byte_t* bp);
+
+/**
+ * Takes a block from its own bin without the arena lock, if one fits the size
+ * with too little left over to split off.
+ * @param heap The heap to search.
+ * @param size The size of the block's data in bytes that must be allocated.
+ * @returns Pointer to the start of the allocated block's data, else NULL.
+ */
+static byte_t* alloc_fast(heap_t* heap, size_t size);
+
+/**
+ * Finds this thread's block cache, adding it to the live caches on first use.
+ * @returns The cache, or NULL if the thread is exiting.
+ */
+static thread_cache_t* get_cache(void);
+
+/**
+ * Takes a block from this thread's cache, refilling the size's class from
+ * the heap if it's empty.
+ * @param arena The arena of this thread.
+ * @param heap The arena's long-lived heap.
+ * @param size The size of the block's data in bytes that must be allocated.
+ * @returns Pointer to the start of the allocated block's data, or NULL if the
+ * size isn't cached or the heap is out of memory.
+ */
+static byte_t* cache_alloc(arena_t* arena, heap_t* heap, size_t size);
+
+/**
+ * Keeps an allocated block in this thread's cache instead of freeing it,
+ * flushing part of its class if that passes the class's limit.
+ * @param heap The heap the block belongs to.
+ * @param bp Pointer to the start of the block's data.
+ * @returns 0 if the block was cached, -1 if it must be freed.
+ */
+static int cache_free(heap_t* heap, byte_t* bp);
+
+/**
+ * Resizes a class's limit once it has seen enough misses and overflows:
+ * larger if it mostly runs dry, smaller if it mostly overflows.
+ * @param cls The class.
+ * @param size The size of the class's blocks' data in bytes.
+ */
+static void cache_adapt(cache_class_t* cls, size_t size);
+
+/**
+ * Takes a batch of blocks for a class from its transfer cache, or else
+ * allocates them under one arena lock.  The cache's lock must not be held,
+ * as allocating may run reclaim callbacks that use the cache.
+ * @param arena The arena of this thread.
+ * @param heap The arena's long-lived heap.
+ * @param size The size of the class's blocks' data in bytes.
+ * @param batch Number of blocks to allocate if none are transferred.
+ * @param tail Set to the last block of the batch.
+ * @param count Set to the number of blocks in the batch.
+ * @returns The first block of the batch, linked through their first words,
+ * or NULL if the heap is out of memory.
+ */
+static byte_t* cache_refill(arena_t* arena, heap_t* heap, size_t size,
+    unsigned batch, byte_t** tail, unsigned* count);
+
+/**
+ * Moves all but the first blocks of a class to a transfer cache as one batch,
+ * or frees them if it's full.
+ * @param cls The class.
+ * @param transfer The class's transfer cache in this thread's arena, or NULL.
+ * @param keep Number of blocks to keep, at least 1.
+ */
+static void cache_flush(cache_class_t* cls, transfer_t* transfer,
+    unsigned keep);
+
+/**
+ * Pops a batch from a transfer cache.
+ * @param transfer The transfer cache.
+ * @param tail Set to the last block of the batch.
+ * @param count Set to the number of blocks in the batch.
+ * @returns The first block of the batch, or NULL if the transfer cache has no
+ * batches.
+ */
+static byte_t* transfer_take(transfer_t* transfer, byte_t** tail,
+    unsigned* count);
+
+/**
+ * Pushes a batch onto a transfer cache.
+ * @param transfer The transfer cache.
+ * @param bp First block of the batch, linked through their first words.
+ * @returns 0 on success, -1 if the transfer cache is full.
+ */
+static int transfer_put(transfer_t* transfer, byte_t* bp);
+
+/**
+ * Takes every batch out of a transfer cache, unless a batch has moved since
+ * the last time it was drained.
+ * @param transfer The transfer cache.
+ * @param chain Blocks to link the batches' blocks in front of.
+ * @param all Take the batches even if one has moved.
+ * @returns The batches' blocks followed by the chain.
+ */
+static byte_t* drain_transfer(transfer_t* transfer, byte_t* chain, int all);
+
+/**
+ * Takes every block out of a cache and resets its limits.  The cache's lock
+ * must be held.
+ * @param cache The cache.
+ * @param chain Blocks to link the cache's blocks in front of.
+ * @returns The cache's blocks followed by the chain.
+ */
+static byte_t* empty_cache(thread_cache_t* cache, byte_t* chain);
+
+/**
+ * Frees a chain of cached blocks to their arenas.
+ * @param bp First block of the chain, linked through their first words.
+ */
+static void free_cached(byte_t* bp);
+
+/**
+ * Empties the caches of threads that haven't used them for the given time,
+ * and the transfer caches no batch has moved through since the last call.
+ * Caches in use by their thread at the moment are skipped.
+ * @param now The time in milliseconds.
+ * @param idle_ms Minimum time the caches must have been idle, or 0 for all.
+ */
+static void scavenge_caches(word_t now, word_t idle_ms);
+
+/**
+ * Finds this thread's epoch record, adding it to the live records on first
+ * use.
+ * @returns The record, or NULL if the thread is exiting.
+ */
+static epoch_record_t* get_epoch_record(void);
+
+/**
+ * Adds a block to the first of a list of bags, or to a new bag in front of
+ * them if it's full or of an older epoch.
+ * @param bags The list of bags.
+ * @param ptr The block, as passed to unlock_deferred.
+ * @param epoch The current epoch.
+ * @returns 0 on success, -1 if no bag could be allocated.
+ */
+static int defer_block(bag_t** bags, void* ptr, word_t epoch);
+
+/**
+ * Frees the blocks in a list of bags, then keeps the bags for reuse.
+ * @param bag The first bag, or NULL.
+ */
+static void release_bags(bag_t* bag);
+
+/**
+ * Frees this thread's deferred blocks whose epoch has expired.
+ * @param record This thread's epoch record.
+ * @param epoch The current epoch.
+ */
+static void epoch_collect(epoch_record_t* record, word_t epoch);
+
+/**
+ * Advances the global epoch if every thread in a critical section has
+ * entered the current one, then frees the blocks of exited threads that have
+ * expired.
+ * @returns The global epoch.
+ */
+static word_t epoch_advance(void);
+
+/**
+ * Removes a free block from the free list, unless an allocation that took
+ * only the bin's lock claimed it first.  The arena lock must be held, which
+ * keeps the block's size from changing.
+ * @param heap The heap the block belongs to.
+ * @param fp Pointer to the start of a free block's data.
+ * @returns 0 on success, -1 if the block is no longer free.
+ */
+static int remove_free_block(heap_t* heap, byte_t* fp);
+
+/**
+ * Removes a free block from the free list of its bin and adjusts its
+ * neighbor's next and prev pointers.  The bin's lock must be held.
+ * @param heap The heap the block belongs to.
+ * @param fp Pointer to the start of a free block's data.
+ */
+static void unlink_free_block(heap_t* heap, byte_t* fp);
+
+/**
+ * Inserts a free block into the free list of its bin, at the head or in
+ * address order depending on the order policy.
+ * @param heap The heap the block belongs to.
+ * @param fp Pointer to the start of a free block's data.
+ */
+static void insert_free_block(heap_t* heap, byte_t* fp);
+
+/**
+ * Extends the heap with a new free block and inserts it into the free list.
+ * The block grows the sbrk segment in place if the heap has one and nothing
+ * else moved the break, else it fills a newly mapped segment.
+ * @param heap The heap to extend.
+ * @param size The number of bytes that need to be in the block's data.
+ * @returns 0 on success, -1 on failure.
+ */
+static int extend_heap(heap_t* heap, size_t size);
+
+/**
+ * Maps a new segment for the heap holding one free block of at least the
+ * given size, and inserts the block into the free list.
+ * @param heap The heap to extend.
+ * @param size The aligned number of bytes that need to be in the block's data.
+ * @returns 0 on success, -1 on failure.
+ */
+static int map_segment(heap_t* heap, size_t size);
+
+/**
+ * Returns a drained segment to the system.
+ * @param heap The heap the segment belongs to.
+ * @param fp Pointer to the start of the free block spanning the segment,
+ * which must not be in the free list.
+ */
+static void release_segment(heap_t* heap, byte_t* fp);
+
+/**
+ * Place an allocated block of at least the given size at the given free block.
+ * Adjusts the given size to abide by the byte alignment and minimum block
+ * size, and puts any leftovers back in the free lists.
+ * @param heap The heap the block belongs to.
+ * @param fp Pointer to the start of a free block's data, already taken out of
+ * the free lists.
+ * @param size The size of the block that must be allocated.
+ * @param pad Bytes at the start of the free block to split off as their own
+ * free block before the allocated one; 0 or at least `MIN_BLOCK_SIZE`.
+ * @returns Pointer to the start of the allocated block's data.
+ */
+static byte_t* place(heap_t* heap, byte_t* fp, word_t size, word_t pad);
+
+/**
+ * Picks the padding that gives a large block the next cache color, rotating
+ * its start across cache lines so equal-sized large blocks don't all alias to
+ * the same cache sets.
+ * @param fp Pointer to the start of the free block chosen for the block.
+ * @param size The aligned size of the block's data in bytes.
+ * @returns Bytes of padding to place before the block, or 0 if the block
+ * isn't colored or the free block has no room for the padding.
+ */
+static word_t color_pad(byte_t* fp, word_t size);
+
+/**
+ * Finds a free block that can fit an allocated block of the given size, and
+ * takes it out of the free lists.
+ * @param heap The heap to search.
+ * @param size The size of the block's data in bytes that must be allocated.
+ * @returns Pointer to the start of a free block's data, if one exists of the
+ * needed size.  Else returns null.
+ */
+static byte_t* find_fit(heap_t* heap, word_t size);
+
+/**
+ * Reads options from the `MLOCK_OPTIONS` environment variable, a comma
+ * separated list of `name=value` pairs.  Sizes may end in K, M or G.
+ * @param opts Options to overwrite with those found in the environment.
+ */
+static void read_env_options(mlock_options_t* opts);
+
+/**
+ * Faults in every page of the given range so first use doesn't have to.
+ * @param start First byte of the range.
+ * @param size Size of the range in bytes.
+ */
+static void prefault(byte_t* start, size_t size);
+
+/**
+ * @param heap The heap to grow.
+ * @param size The size of the block's data that must fit, in bytes.
+ * @returns How many bytes to grow the heap by under the growth policy.
+ */
+static size_t grow_size(heap_t* heap, size_t size);
+
+/**
+ * @returns The bytes all heaps have taken from the system.
+ */
+static size_t heap_bytes(void);
+
+/**
+ * Frees up memory before the heap grows past its soft limit: purges every
+ * free page, then runs the reclaim callbacks and looks for a fit again.
+ * @param heap The heap the block must come from.
+ * @param size The aligned size of the block's data that must fit, in bytes.
+ * @returns Pointer to the start of a free block's data that fits, else NULL.
+ */
+static byte_t* reclaim(heap_t* heap, word_t size);
+
+/**
+ * @param heap A heap.
+ * @returns The size of the free block at the top of the heap's sbrk segment,
+ * or 0 if the last block is allocated or the heap doesn't grow with sbrk.
+ */
+static word_t top_free_size(heap_t* heap);
+
+/**
+ * Allocates a block for the user, tagging and reporting it as needed.
+ * @param size The minimum size of the block's data in bytes.
+ * @param tag The allocation tag, or 0 for an untagged block.
+ * @param hint The allocation's lifetime hint, or `HINT_NONE` to go by the
+ * thread's hint.
+ * @param site Return address of the call into m-lock.
+ * @returns A pointer to the start of the block's data, else NULL.
+ */
+static void* alloc_user(size_t size, int tag, int hint, void* site);
+
+/**
+ * Samples, tracks, tags and reports a block just allocated for the user.
+ * @param bp Pointer to the start of the block's data, or NULL if allocation
+ * failed.
+ * @param size The size in bytes the user asked for.
+ * @param tag The allocation tag, or 0 for an untagged block.
+ * @param site Return address of the call into m-lock, or NULL if the block's
+ * lifetime was hinted and mustn't be measured.
+ * @returns A pointer to the start of the user's data, else NULL.
+ */
+static void* finish_user(byte_t* bp, size_t size, int tag, void* site);
+
+/**
+ * Takes a free block close to the given one: first among its neighbors,
+ * then the nearest in the first few blocks of each bin that lies in the same
+ * segment.  The arena lock must be held.
+ * @param heap The heap the block belongs to.
+ * @param span The segment the block lies in.
+ * @param bp Pointer to the start of an allocated block's data.
+ * @param size The size of the block's data in bytes that must be allocated.
+ * @returns Pointer to the start of the allocated block's data, else NULL.
+ */
+static byte_t* alloc_near(heap_t* heap, span_t* span, byte_t* bp,
+    size_t size);
+
+/**
+ * Picks the heap for an allocation by its hint, or when lifetimes are
+ * predicted and it has no hint, by what was learned about the allocation
+ * site.
+ * @param arena The arena to allocate from.
+ * @param hint The allocation's lifetime hint, or `HINT_NONE`.
+ * @param site Return address of the call into m-lock.
+ * @returns The heap to allocate from.
+ */
+static heap_t* pick_heap(arena_t* arena, int hint, void* site);
+
+/**
+ * Starts measuring the lifetime of every `TRACK_INTERVAL`th allocated block.
+ * If the block's slot is taken by one that has outlived the short lifetime
+ * already, that one is counted as long-lived and replaced.
+ * @param bp Pointer to the start of an allocated block's data.
+ * @param site Return address of the call into m-lock.
+ */
+static void track_block(byte_t* bp, void* site);
+
+/**
+ * Stops measuring the lifetime of a block.
+ * @param bp Pointer to the start of an allocated block's data.
+ * @param learn If set, the block is being freed and its lifetime is counted
+ * against its site.
+ */
+static void untrack_block(byte_t* bp, int learn);
+
+/**
+ * Counts one block's lifetime against its site.
+ * @param site The allocation site.
+ * @param lifetime Bytes allocated during the block's life.
+ */
+static void learn_lifetime(site_t* site, word_t lifetime);
+
+/**
+ * Allocates a heap block of at least the given size.
+ * @param heap The heap to allocate from.
+ * @param size The minimum size of the block's data in bytes.
+ * @returns Pointer to the start of the block's data, else NULL.
+ */
+static byte_t* alloc_block(heap_t* heap, size_t size);
+
+/**
+ * Frees the given heap block, coalescing it with its neighbors and inserting
+ * it into the free list.  A segment the block drains may be released instead.
+ * @param heap The heap the block belongs to.
+ * @param bp Pointer to the start of an allocated block's data.
+ */
+static void free_block(heap_t* heap, byte_t* bp);
+
+/**
+ * Resizes the given heap block, in place if possible.
+ * @param heap The heap the block belongs to.
+ * @param bp Pointer to the start of an allocated block's data.
+ * @param size The new minimum size of the block's data in bytes.
+ * @returns Pointer to the start of the resized block's data, else NULL with
+ * the original block untouched.
+ */
+static byte_t* realloc_block(heap_t* heap, byte_t* bp, size_t size);
+
+/**
+ * Resizes the given heap block without moving it, shrinking into a new free
+ * block or growing into the next block if it is free.
+ * @param heap The heap the block belongs to.
+ * @param bp Pointer to the start of an allocated block's data.
+ * @param size The new minimum size of the block's data in bytes.
+ * @returns 0 on success, -1 if the block can't be resized in place.
+ */
+static int resize_block(heap_t* heap, byte_t* bp, size_t size);
+
+/**
+ * Resizes a pointer returned by mlock, keeping its tag, hook mark and
+ * accounting.
+ * @param ptr A pointer returned by mlock.
+ * @param size The new size in bytes.
+ * @param in_place If set, fail instead of moving the block.
+ * @param site Return address of the call into m-lock.
+ * @returns The resized pointer, else NULL with the original untouched.
+ */
+static void* resize(void* ptr, size_t size, int in_place, void* site);
+
+/**
+ * Moves a user's block into the arena this thread holds, keeping its tag,
+ * without reporting the allocation or free to the hooks.
+ * @param ptr A pointer returned by mlock.
+ * @param size The new size in bytes.
+ * @param site Return address of the call into m-lock.
+ * @returns The moved pointer, else NULL with the original untouched.
+ */
+static void* move_user(void* ptr, size_t size, void* site);
+
+/**
+ * Resizes a user's block within its own heap, taking its arena's lock.
+ * @param heap The heap the block belongs to.
+ * @param ptr A pointer returned by mlock.
+ * @param size The new size in bytes.
+ * @param in_place If set, fail instead of moving the block.
+ * @returns The resized pointer, else NULL with the original untouched.
+ */
+static void* resize_user(heap_t* heap, void* ptr, size_t size, int in_place);
+
+/**
+ * Counts live bytes and blocks against a tag, publishing this thread's counts
+ * once they drift far enough.
+ * @param tag The allocation tag.
+ * @param bytes Change in live bytes.
+ * @param count Change in live blocks.
+ */
+static void tag_account(int tag, long bytes, long count);
+
+/**
+ * Publishes this thread's counts for a tag and checks its soft limit.
+ * @param tag The allocation tag.
+ */
+static void tag_publish(int tag);
+
+/**
+ * @returns The time from a monotonic clock in milliseconds, never 0.
+ */
+static word_t now_ms(void);
+
+/**
+ * Counts an allocator call, and every `PURGE_TICKS` calls purges free memory
+ * that has been idle for the decay time, at most once per quarter of it, and
+ * scavenges thread caches idle for `cache_idle_ms`, at most once per half.
+ */
+static void purge_tick(void);
+
+/**
+ * Returns the whole pages inside free blocks that have been free for at least
+ * the given time to the system.  The blocks stay free and in their lists.
+ * @param idle_ms Minimum time the blocks must have been free.
+ * @returns The number of bytes purged.
+ */
+static size_t purge_idle(word_t idle_ms);
+
+/**
+ * Purges the idle free blocks of one heap.
+ * @param heap The heap.
+ * @param now The current time in milliseconds.
+ * @param idle_ms Minimum time the blocks must have been free.
+ * @returns The number of bytes purged.
+ */
+static size_t purge_heap(heap_t* heap, word_t now, word_t idle_ms);
+
+/**
+ * Decides whether an allocation of the given size is reported to the hooks.
+ * Allocations are sampled whenever any hook reports on blocks, so frees and
+ * resizes are seen even without an on_alloc hook.
+ * @param size The number of bytes being allocated.
+ * @returns The hooks to report the allocation to, else NULL.
+ */
+static const mlock_hooks_t* should_sample(size_t size);
+
+/**
+ * Makes sure thread_exit runs when this thread exits.
+ */
+static void register_thread(void);
+
+/**
+ * Publishes all of an exiting thread's counts, returns its cached pool
+ * objects and blocks, and leaves its deferred blocks to other threads.
+ * @param arg Unused.
+ */
+static void thread_exit(void* arg);
+
+/**
+ * Finds this thread's cache for the given pool, taking over the cache's slot
+ * from any other pool.
+ * @param pool A pool.
+ * @returns The thread's cache of the pool's objects.
+ */
+static pool_cache_t* pool_cache(mlock_pool_t* pool);
+
+/**
+ * Moves a batch of objects from the pool to a thread cache, grabbing a new
+ * slab if the pool has none left.
+ * @param pool The pool.
+ * @param cache This thread's cache of the pool's objects.
+ * @returns 0 on success, -1 if the pool couldn't grow.
+ */
+static int pool_refill(mlock_pool_t* pool, pool_cache_t* cache);
+
+/**
+ * Moves objects from a thread cache back to its pool's shared free list.
+ * Objects of a destroyed pool are dropped.
+ * @param cache A thread cache.
+ * @param count The number of objects to move.
+ */
+static void pool_flush(pool_cache_t* cache, unsigned count);
+
+/**
+ * Runs the pool's destructor, if any, on a list of its free objects.
+ * @param pool The pool.
+ * @param obj The first object of a list linked through the pool's link word.
+ */
+static void destroy_objects(mlock_pool_t* pool, byte_t* obj);
+
+/**
+ * Hands slabs back to their heaps, restoring their pages in the page map.
+ * Takes the global lock and an arena's lock, so the pool lock must not be
+ * held, nor the global lock unless under an arena's lock.
+ * @param slab The first slab of a list linked through next.
+ * @returns The number of bytes of slabs handed back.
+ */
+static size_t release_slabs(slab_t* slab);
+
+/**
+ * Carves a new slab for the pool out of the thread's long-lived heap.  Takes
+ * the arena lock, so the pool lock must not be held.
+ * @param pool The pool.
+ * @returns The slab, else NULL.
+ */
+static slab_t* grab_slab(mlock_pool_t* pool);
+
+/**
+ * Locks a range of pages in memory, faulting them in.
+ * @param start First byte of the range, on a page boundary.
+ * @param size Size of the range in bytes.
+ * @returns 0 on success, -1 on failure.
+ */
+static int pin_pages(byte_t* start, size_t size);
+
+/**
+ * Maps the same pages of a new anonymous file at both halves of a reserved
+ * range, replacing the reservation.
+ * @param start First byte of the range, on a page boundary.
+ * @param size Size of each half in bytes, in whole pages.
+ * @returns 0 on success, -1 on failure.
+ */
+static int map_ring(byte_t* start, size_t size);
+
+/**
+ * Creates the key used to run thread_exit.
+ */
+static void make_thread_key(void);
+
+/**
+ * Allocates zeroed memory for allocator metadata, which is never returned to
+ * the heap.
+ * @param size The number of bytes needed.
+ * @returns Pointer to the memory on a success, else NULL.
+ */
+static void* meta_alloc(size_t size);
+
+/**
+ * Maps every page overlapping the given range to the given span.
+ * @param start First byte of the range.
+ * @param size Size of the range in bytes.
+ * @param span The span descriptor, or NULL to unmap the pages.
+ * @returns 0 on success, -1 on failure.
+ */
+static int pagemap_set(byte_t* start, size_t size, span_t* span);
+
+/**
+ * Looks up the span the page of the given pointer belongs to.
+ * @param ptr Any pointer.
+ * @returns The span descriptor, or NULL if m-lock doesn't manage the page.
+ */
+static span_t* pagemap_get(const void* ptr);
+
+#ifdef MLOCK_ENABLE_FREE_INDEX
+/**
+ * Adds a free block to the free index.  If the index can't grow, the block is
+ * left out and will only be found again once it is coalesced.
+ * @param heap The heap the block belongs to.
+ * @param fp Pointer to the start of a free block's data.
+ */
+static void index_insert(heap_t* heap, byte_t* fp);
+
+/**
+ * Removes a free block from the free index.
+ * @param heap The heap the block belongs to.
+ * @param fp Pointer to the start of a free block's data.
+ */
+static void index_remove(heap_t* heap, byte_t* fp);
+
+/**
+ * Finds a free block that can fit the given size using the free index.
+ * @param heap The heap to search.
+ * @param size The aligned size of the block's data in bytes.
+ * @returns Pointer to the start of a free block's data, else null.
+ */
+static byte_t* index_find(heap_t* heap, word_t size);
+#endif
+
+// ---[ FUNCTION DEFINITIONS ]-------------------------------------------------
+
+void mlock_default_options(mlock_options_t* opts)
+{
+    opts->initial_size = CHUNK_SIZE;
+    opts->chunk_size = CHUNK_SIZE;
+    opts->grow_policy = MLOCK_GROW_FIXED;
+    opts->fit_policy = MLOCK_FIT_FIRST;
+    opts->order_policy = MLOCK_ORDER_LIFO;
+    opts->split_threshold = MIN_BLOCK_SIZE;
+    opts->color_threshold = 0;
+    opts->color_count = PAGE_SIZE / COLOR_STEP;
+    opts->prefault = 0;
+    opts->decay_ms = 10000;
+    opts->short_lifetime = 0;
+    opts->arenas = 0;
+    opts->cache_idle_ms = 1000;
+}
+
+void* init_lock(void)
+{
+    mlock_options_t opts;
+    mlock_default_options(&opts);
+    read_env_options(&opts);
+    return init_lock_ex(&opts);
+}
+
+void* init_lock_ex(const mlock_options_t* opts)
+{
+    lock_meta();
+    void* start = init_heap(opts);
+    unlock_meta();
+    return start;
+}
+
+static void* init_heap(const mlock_options_t* opts)
+{
+    DEBUG("Initializing memory");
+
+    if (heap_span != NULL) {
+        DEBUG("Memory is already initialized");
+        return heap_span->start + WORD_SIZE * 2;
+    }
+
+    if (opts == NULL) {
+        mlock_default_options(&options);
+    } else {
+        options = *opts;
+    }
+
+    options.initial_size
+        = ALIGN_BYTES(MAX(options.initial_size, MIN_DATA_SIZE));
+    options.chunk_size = ALIGN_BYTES(MAX(options.chunk_size, MIN_DATA_SIZE));
+    options.split_threshold = MAX(options.split_threshold, MIN_BLOCK_SIZE);
+    options.color_count = MAX(options.color_count, 1);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpus = cpus > 0 ? cpus : 1;
+
+    if (options.arenas == 0) {
+        options.arenas = ARENAS_PER_CPU * cpus;
+    }
+
+    // On a single CPU a lock's holder can't run while another thread spins
+    lock_spins = cpus > 1 ? LOCK_SPINS : 0;
+
+    arena_count = options.arenas < MLOCK_MAX_ARENAS ? options.arenas
+                                                     : MLOCK_MAX_ARENAS;
+    ready_arena(&arenas[0]);
+
+    // Allocate initial heap
+    word_t* heap_list = sbrk(WORD_SIZE * 4);
+    word_t* heap_start = heap_list + 2;
+
+    if (heap_list == (void*)-1) {
+        DEBUG("Failed initial sbrk");
+        return NULL;
+    }
+
+    PUT_WORD(heap_list++, 0x00DECADE);
+    PUT_WORD(heap_list++, PACK_HEADER(0, ALLOCATED));  // Prologue header
+    PUT_WORD(heap_list++, PACK_HEADER(0, ALLOCATED));  // Prologue boundary tag
+    PUT_WORD(heap_list++, PACK_HEADER(0, ALLOCATED));  // Epilogue header
+
+    heap_span = meta_alloc(sizeof(span_t));
+
+    if (heap_span == NULL) {
+        DEBUG("Failed to allocate the heap span");
+        return NULL;
+    }
+
+    heap_t* heap = &arenas[0].heaps[MLOCK_HINT_LONG];
+    heap_span->kind = SPAN_HEAP;
+    heap_span->start = (byte_t*)(heap_start - 2);
+    heap_span->size = WORD_SIZE * 4;
+    heap_span->owner = heap;
+
+    if (pagemap_set(heap_span->start, heap_span->size, heap_span) == -1) {
+        DEBUG("Failed to map the heap span");
+        return NULL;
+    }
+
+    heap->top = heap_span;
+    heap->size = heap_span->size;
+
+    // extend_heap inserts the free block into the free lists
+    if (extend_heap(heap, options.initial_size) == -1) {
+        DEBUG("Failed to create the first free block");
+        return NULL;
+    }
+
+    if (options.prefault) {
+        prefault(heap_span->start, heap_span->size);
+    }
+
+    DEBUG("Finished initializing memory");
+    return (void*)heap_start;
+}
+
+void* mlock(size_t size)
+{
+    return alloc_user(size, thread_tag, HINT_NONE,
+        __builtin_return_address(0));
+}
+
+void* mlock_tagged(size_t size, int tag)
+{
+    if (tag <= 0 || tag >= MLOCK_MAX_TAGS) {
+        tag = 0;
+    }
+
+    return alloc_user(size, tag, HINT_NONE, __builtin_return_address(0));
+}
+
+void* mlock_hinted(size_t size, int hint)
+{
+    hint = hint == MLOCK_HINT_SHORT ? hint : MLOCK_HINT_LONG;
+    return alloc_user(size, thread_tag, hint, __builtin_return_address(0));
+}
+
+void* mlock_near(const void* hint, size_t size)
+{
+    void* site = __builtin_return_address(0);
+    span_t* span = hint != NULL ? pagemap_get(hint) : NULL;
+
+    if (size == 0 || span == NULL || span->kind != SPAN_HEAP
+        || (byte_t*)hint < span->start
+        || (byte_t*)hint
+            >= span->start + __atomic_load_n(&span->size, __ATOMIC_RELAXED)) {
+        DEBUG("Hint %p isn't a heap block; allocating anywhere", hint);
+        return alloc_user(size, thread_tag, HINT_NONE, site);
+    }
+
+    heap_t* heap = span->owner;
+    arena_t* arena = heap->arena;
+
+    // Waiting on the hint's arena while holding another could deadlock
+    if (locked_arena != NULL && locked_arena != arena) {
+        return alloc_user(size, thread_tag, HINT_NONE, site);
+    }
+
+    int tag = thread_tag;
+    size_t tag_size = tag ? TAG_SIZE : 0;
+    byte_t* hint_bp = (byte_t*)hint - (IS_TAGGED(hint) ? TAG_SIZE : 0);
+    lock_arena(arena);
+    byte_t* bp = alloc_near(heap, span, hint_bp, size + tag_size);
+    unlock_arena(arena);
+
+    if (bp == NULL) {
+        DEBUG("Nothing free near %p; allocating anywhere", hint);
+        return alloc_user(size, tag, HINT_NONE, site);
+    }
+
+    return finish_user(bp, size, tag, site);
+}
+
+int mlock_set_hint(int hint)
+{
+    int old = thread_hint;
+    thread_hint = hint == MLOCK_HINT_SHORT ? hint : MLOCK_HINT_LONG;
+    return old;
+}
+
+void mlock_set_hooks(const mlock_hooks_t* new_hooks)
+{
+    mlock_hooks_t* copy = NULL;
+
+    if (new_hooks != NULL
+        && (new_hooks->on_alloc || new_hooks->on_free
+            || new_hooks->on_realloc || new_hooks->on_grow)) {
+        // Threads may be calling through the old copy, so it's never reused
+        lock_meta();
+        copy = meta_alloc(sizeof(mlock_hooks_t));
+        unlock_meta();
+
+        if (copy == NULL) {
+            DEBUG("Failed to allocate a copy of the hooks");
+            return;
+        }
+
+        *copy = *new_hooks;
+    }
+
+    __atomic_store_n(&hooks, copy, __ATOMIC_RELEASE);
+}
+
+size_t mlock_purge(unsigned long idle_ms)
+{
+    lock_meta();
+    int ready = heap_span != NULL;
+    unlock_meta();
+
+    if (!ready) {
+        return 0;
+    }
+
+    // Blocks left on the remote lists of idle arenas are freed first
+    for (arena_t* arena = arenas; arena < arenas + arena_count; arena++) {
+        if (locked_arena == NULL
+            && __atomic_load_n(&arena->ready, __ATOMIC_ACQUIRE)) {
+            lock_arena(arena);
+            unlock_arena(arena);
+        }
+    }
+
+    scavenge_caches(now_ms(), idle_ms);
+    epoch_record_t* record = get_epoch_record();
+    word_t epoch = epoch_advance();
+
+    if (record != NULL) {
+        epoch_collect(record, epoch);
+    }
+
+    return purge_idle(idle_ms);
+}
+
+void mlock_lock_stats(mlock_lock_stats_t* stats)
+{
+    stats->contended = __atomic_load_n(&lock_contended, __ATOMIC_RELAXED);
+    stats->spun = __atomic_load_n(&lock_spun, __ATOMIC_RELAXED);
+    stats->parked = __atomic_load_n(&lock_parked, __ATOMIC_RELAXED);
+}
+
+int mlock_set_tag(int tag)
+{
+    int old = thread_tag;
+    thread_tag = (tag > 0 && tag < MLOCK_MAX_TAGS) ? tag : 0;
+    return old;
+}
+
+void mlock_tag_stats(int tag, mlock_tag_stats_t* stats)
+{
+    if (tag <= 0 || tag >= MLOCK_MAX_TAGS) {
+        stats->live_bytes = 0;
+        stats->live_count = 0;
+        return;
+    }
+
+    long bytes = __atomic_load_n(&tag_bytes[tag], __ATOMIC_RELAXED)
+        + thread_tag_bytes[tag];
+    long count = __atomic_load_n(&tag_count[tag], __ATOMIC_RELAXED)
+        + thread_tag_count[tag];
+
+    // Other threads' unpublished frees can briefly drive the sum negative
+    stats->live_bytes = bytes > 0 ? bytes : 0;
+    stats->live_count = count > 0 ? count : 0;
+}
+
+int mlock_tag_limit(int tag, size_t soft_limit, mlock_limit_fn fn, void* arg)
+{
+    if (tag <= 0 || tag >= MLOCK_MAX_TAGS) {
+        return -1;
+    }
+
+    tag_limit_t* copy = NULL;
+
+    if (soft_limit != 0) {
+        // Threads may be publishing against the old copy, so it's never reused
+        lock_meta();
+        copy = meta_alloc(sizeof(tag_limit_t));
+        unlock_meta();
+
+        if (copy == NULL) {
+            DEBUG("Failed to allocate a copy of tag %d's limit", tag);
+            return -1;
+        }
+
+        copy->bytes = soft_limit;
+        copy->fn = fn;
+        copy->arg = arg;
+    }
+
+    __atomic_store_n(&tag_limits[tag], copy, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void* alloc_user(size_t size, int tag, int hint, void* site)
+{
+    DEBUG("Starting malloc of size %ld with tag %d", size, tag);
+
+    if (size <= 0) {
+        DEBUG("Can't malloc of size %ld", size);
+        return NULL;
+    }
+
+    arena_t* arena = pick_arena();
+
+    if (arena == NULL) {
+        DEBUG("Failed to initialize memory on first use");
+        return NULL;
+    }
+
+    if (hint == HINT_NONE && thread_hint != MLOCK_HINT_LONG) {
+        hint = thread_hint;
+    }
+
+    size_t tag_size = tag ? TAG_SIZE : 0;
+    heap_t* heap = pick_heap(arena, hint, site);
+    byte_t* bp = NULL;
+
+    if (heap == &arena->heaps[MLOCK_HINT_LONG]) {
+        bp = cache_alloc(arena, heap, size + tag_size);
+    }
+
+    if (bp == NULL) {
+        bp = alloc_fast(heap, size + tag_size);
+    }
+
+    if (bp == NULL) {
+        lock_arena(arena);
+        bp = alloc_block(heap, size + tag_size);
+        unlock_arena(arena);
+    }
+
+    // A hinted block says nothing about the lifetimes of its site's others
+    return finish_user(bp, size, tag, hint == HINT_NONE ? site : NULL);
+}
+
+static void* finish_user(byte_t* bp, size_t size, int tag, void* site)
+{
+    size_t tag_size = tag ? TAG_SIZE : 0;
+    const mlock_hooks_t* sampled = bp != NULL ? should_sample(size) : NULL;
+
+    if (sampled != NULL) {
+        MARK_SAMPLED(bp);
+    }
+
+    if (bp != NULL && site != NULL && options.short_lifetime) {
+        __atomic_add_fetch(&alloc_clock, size, __ATOMIC_RELAXED);
+        unsigned tick = __atomic_add_fetch(&track_ticks, 1, __ATOMIC_RELAXED);
+
+        if (tick % TRACK_INTERVAL == 0) {
+            lock_meta();
+            track_block(bp, site);
+            unlock_meta();
+        }
+    }
+
+    if (bp == NULL) {
+        TRACE(mlock, size, NULL, tag);
+        return NULL;
+    }
+
+    byte_t* ptr = bp + tag_size;
+
+    if (tag) {
+        tag_account(tag, GET_SIZE(bp), 1);
+        PUT_WORD(ptr - WORD_SIZE, PACK_TAG(tag));
+    }
+
+    TRACE(mlock, size, ptr, tag);
+
+    if (sampled != NULL && sampled->on_alloc != NULL) {
+        in_hook = 1;
+        sampled->on_alloc(ptr, size, sampled->arg);
+        in_hook = 0;
+    }
+
+    return ptr;
+}
+
+static byte_t* alloc_near(heap_t* heap, span_t* span, byte_t* bp,
+    size_t size)
+{
+    size = ALIGN_BYTES(size);
+    size = MAX(size, MIN_DATA_SIZE);
+
+    // A free neighbor shares the hint's pages, and often its cache lines;
+    // after the hint first, as structures are mostly walked forward
+    byte_t* fp = bp;
+
+    for (int i = 0; i < NEAR_SCAN; i++) {
+        fp = GET_NEXT_BLOCK(fp);
+
+        if (GET_SIZE(fp) == 0) {
+            break;  // Epilogue
+        }
+
+        if (GET_ALLOC(fp) == FREE && GET_SIZE(fp) >= size
+            && remove_free_block(heap, fp) == 0) {
+            return place(heap, fp, size, 0);
+        }
+    }
+
+    fp = bp;
+
+    for (int i = 0; i < NEAR_SCAN && GET_PREV_SIZE(fp) != 0; i++) {
+        fp = GET_PREV_BLOCK(fp);
+
+        if (GET_ALLOC(fp) == FREE && GET_SIZE(fp) >= size
+            && remove_free_block(heap, fp) == 0) {
+            return place(heap, fp, size, 0);
+        }
+    }
+
+    // Then the nearest free block of the same segment the bins turn up
+    byte_t* end = span->start + __atomic_load_n(&span->size, __ATOMIC_RELAXED);
+    word_t bins = __atomic_load_n(&heap->bins_used, __ATOMIC_ACQUIRE);
+    byte_t* best = NULL;
+    word_t best_distance = (word_t)-1;
+
+    for (int bin = SIZE_BIN(size); bin < NUM_BINS; bin++) {
+        if (!(bins & (1ULL << bin))) {
+            continue;
+        }
+
+        heap_lock(&heap->bin_locks[bin]);
+        fp = heap->free_lists[bin];
+
+        for (int i = 0; fp != NULL && i < NEAR_SCAN; i++) {
+            word_t distance = fp > bp ? fp - bp : bp - fp;
+
+            if (fp >= span->start && fp < end && GET_SIZE(fp) >= size
+                && distance < best_distance) {
+                best = fp;
+                best_distance = distance;
+            }
+
+            fp = GET_NEXT_FREE(fp);
+        }
+
+        heap_unlock(&heap->bin_locks[bin]);
+    }
+
+    if (best != NULL && remove_free_block(heap, best) == 0) {
+        return place(heap, best, size, 0);
+    }
+
+    return NULL;
+}
+
+static heap_t* pick_heap(arena_t* arena, int hint, void* site)
+{
+    if (hint != HINT_NONE) {
+        return &arena->heaps[hint];
+    }
+
+    if (!options.short_lifetime) {
+        return &arena->heaps[MLOCK_HINT_LONG];
+    }
+
+    // Scores change under the global lock, which this doesn't take
+    site_t* entry = &sites[HASH_PTR(site, SITE_COUNT)];
+
+    if (__atomic_load_n(&entry->site, __ATOMIC_RELAXED) == site
+        && __atomic_load_n(&entry->score, __ATOMIC_RELAXED) >= SCORE_SHORT) {
+        return &arena->heaps[MLOCK_HINT_SHORT];
+    }
+
+    return &arena->heaps[MLOCK_HINT_LONG];
+}
+
+static void track_block(byte_t* bp, void* site)
+{
+    word_t now = __atomic_load_n(&alloc_clock, __ATOMIC_RELAXED);
+    tracked_t* slot = &tracked[HASH_PTR(bp, TRACK_COUNT)];
+
+    if (slot->bp != NULL) {
+        word_t age = now - slot->birth;
+
+        // Keep measuring the block there until it shows it's long-lived
+        if (age < options.short_lifetime) {
+            return;
+        }
+
+        learn_lifetime(slot->site, age);
+    }
+
+    site_t* entry = &sites[HASH_PTR(site, SITE_COUNT)];
+
+    if (entry->site != site) {
+        // Another site hashed here; start over for this one
+        __atomic_store_n(&entry->score, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->site, site, __ATOMIC_RELAXED);
+    }
+
+    slot->bp = bp;
+    slot->site = entry;
+    slot->birth = now;
+    MARK_TRACKED(bp);
+}
+
+static void untrack_block(byte_t* bp, int learn)
+{
+    tracked_t* slot = &tracked[HASH_PTR(bp, TRACK_COUNT)];
+
+    if (slot->bp != bp) {
+        // The block's measurement was already counted as long-lived
+        return;
+    }
+
+    if (learn) {
+        learn_lifetime(slot->site,
+            __atomic_load_n(&alloc_clock, __ATOMIC_RELAXED) - slot->birth);
+    }
+
+    slot->bp = NULL;
+}
+
+static void learn_lifetime(site_t* site, word_t lifetime)
+{
+    // Long-lived blocks weigh more, as mistaking one for short-lived pins a
+    // whole segment
+    int score = site->score;
+
+    if (lifetime < options.short_lifetime) {
+        score = score < SCORE_MAX ? score + 1 : SCORE_MAX;
+    } else {
+        score = score > 4 ? score - 4 : 0;
+    }
+
+    __atomic_store_n(&site->score, score, __ATOMIC_RELAXED);
+}
+
+static byte_t* alloc_block(heap_t* heap, size_t size)
+{
+    DEBUG("Starting malloc of size %ld", size);
+
+    if (size <= 0) {
+        DEBUG("Can't malloc of size %ld", size);
+        return NULL;
+    }
+
+    purge_tick();
+
+    size = ALIGN_BYTES(size);
+    size = MAX(size, MIN_DATA_SIZE);
+    byte_t* fp = find_fit(heap, size);
+
+    if (fp != NULL) {
+        fp = place(heap, fp, size, color_pad(fp, size));
+        DEBUG("Placed block at %p", fp);
+        return fp;
+    }
+
+    // No available blocks; extend heap to get more, with room to color
+    size_t color_room = 0;
+
+    if (options.color_threshold && size >= options.color_threshold) {
+        color_room = (options.color_count - 1) * COLOR_STEP;
+    }
+
+    size_t grow = grow_size(heap, size + color_room);
+    size_t limit = soft_limit ? soft_limit : hard_limit;
+
+    if (limit && heap_bytes() + grow > limit && !in_reclaim) {
+        fp = reclaim(heap, size);
+
+        if (fp != NULL) {
+            fp = place(heap, fp, size, color_pad(fp, size));
+            DEBUG("Placed reclaimed block at %p", fp);
+            return fp;
+        }
+
+        // Near the limit, only grow by what the top free block lacks
+        word_t top = top_free_size(heap);
+        grow = size + color_room;
+
+        if (top != 0) {
+            grow = top + HEADER_SIZE + BOUNDARY_SIZE >= grow
+                ? MIN_DATA_SIZE
+                : MAX(grow - top - HEADER_SIZE - BOUNDARY_SIZE,
+                    MIN_DATA_SIZE);
+        }
+    }
+
+    if (extend_heap(heap, grow) == -1) {
+        DEBUG("Failed to extend memory by %ld bytes", size);
+        return NULL;
+    }
+
+    // extend_heap put the result in the free lists
+    fp = find_fit(heap, size + color_room);
+
+    if (fp == NULL) {
+        // An allocation that took only a bin's lock got the new block first
+        DEBUG("Lost the extended block; extending again");
+        return alloc_block(heap, size);
+    }
+
+    fp = place(heap, fp, size, color_pad(fp, size));
+    DEBUG("Malloc-ed extended block of size %ld at pointer %p", size, fp);
+    return fp;
+}
+
+int mlock_set_limit(size_t soft, size_t hard)
+{
+    if (hard != 0 && soft > hard) {
+        return -1;
+    }
+
+    soft_limit = soft;
+    hard_limit = hard;
+    return 0;
+}
+
+int mlock_add_reclaim(mlock_reclaim_fn fn, void* arg)
+{
+    lock_meta();
+
+    if (fn == NULL || reclaim_count == MLOCK_MAX_RECLAIMS) {
+        unlock_meta();
+        return -1;
+    }
+
+    // Arenas read the callbacks without the global lock
+    reclaim_fns[reclaim_count] = fn;
+    reclaim_args[reclaim_count] = arg;
+    __atomic_store_n(&reclaim_count, reclaim_count + 1, __ATOMIC_RELEASE);
+    unlock_meta();
+    return 0;
+}
+
+static byte_t* reclaim(heap_t* heap, word_t size)
+{
+    DEBUG("Reclaiming before growing past the limit for %ld bytes", size);
+    in_reclaim = 1;
+
+    // Free pages go back first, which costs the application nothing but page
+    // faults
+    purge_idle(0);
+
+    // Then blocks other threads have cached, which they can allocate again,
+    // and deferred blocks nobody can read any more
+    scavenge_caches(now_ms(), 0);
+    epoch_record_t* record = get_epoch_record();
+    word_t epoch = epoch_advance();
+
+    if (record != NULL) {
+        epoch_collect(record, epoch);
+    }
+
+    // Then slabs of caches nobody holds objects from, whose objects cost
+    // destructor calls to rebuild
+    lock_meta();
+
+    for (mlock_pool_t* pool = live_pools; pool != NULL; pool = pool->next) {
+        mlock_pool_reap(pool);
+    }
+
+    unlock_meta();
+    byte_t* fp = find_fit(heap, size);
+    int count = __atomic_load_n(&reclaim_count, __ATOMIC_ACQUIRE);
+
+    // Callbacks may wait on threads allocating from this arena, and blocks
+    // they free while it's held would be left on remote lists, so they run
+    // with its lock released unless an outer call of this thread holds it
+    arena_t* arena = heap->arena;
+    int release = locked_depth == 1;
+
+    for (int i = 0; i < count && fp == NULL; i++) {
+        if (release) {
+            unlock_arena(arena);
+        }
+
+        reclaim_fns[i](size, reclaim_args[i]);
+
+        if (release) {
+            lock_arena(arena);
+        }
+
+        fp = find_fit(heap, size);
+    }
+
+    in_reclaim = 0;
+    return fp;
+}
+
+static word_t top_free_size(heap_t* heap)
+{
+    if (heap->top == NULL) {
+        return 0;
+    }
+
+    byte_t* epilogue = heap->top->start + heap->top->size - HEADER_SIZE;
+    byte_t* boundary = epilogue - BOUNDARY_SIZE;
+
+    if (GET_ALLOC_FROM_HEADER(boundary) == ALLOCATED) {
+        return 0;
+    }
+
+    return GET_SIZE_FROM_HEADER(boundary);
+}
+
+static void read_env_options(mlock_options_t* opts)
+{
+    const char* env = getenv("MLOCK_OPTIONS");
+
+    while (env != NULL && *env != '\0') {
+        const char* value = strchr(env, '=');
+        const char* end = strchr(env, ',');
+        end = end ? end : env + strlen(env);
+
+        if (value == NULL || value > end) {
+            DEBUG("Ignoring malformed option at %s", env);
+            env = *end ? end + 1 : end;
+            continue;
+        }
+
+        size_t name_len = value - env;
+        value++;
+
+        char* suffix;
+        size_t number = strtoul(value, &suffix, 10);
+        switch (*suffix) {
+        case 'G':
+        case 'g':
+            number <<= 10;
+            // fall through
+        case 'M':
+        case 'm':
+            number <<= 10;
+            // fall through
+        case 'K':
+        case 'k':
+            number <<= 10;
+            break;
+        }
+
+#define OPTION_IS(name)                                                       \
+    (name_len == sizeof(name) - 1 && strncmp(env, name, name_len) == 0)
+#define VALUE_IS(name)                                                        \
+    ((size_t)(end - value) == sizeof(name) - 1                                \
+        && strncmp(value, name, end - value) == 0)
+
+        if (OPTION_IS("initial_size")) {
+            opts->initial_size = number;
+        } else if (OPTION_IS("chunk_size")) {
+            opts->chunk_size = number;
+        } else if (OPTION_IS("split_threshold")) {
+            opts->split_threshold = number;
+        } else if (OPTION_IS("color_threshold")) {
+            opts->color_threshold = number;
+        } else if (OPTION_IS("color_count")) {
+            opts->color_count = number;
+        } else if (OPTION_IS("decay_ms")) {
+            opts->decay_ms = number;
+        } else if (OPTION_IS("short_lifetime")) {
+            opts->short_lifetime = number;
+        } else if (OPTION_IS("arenas")) {
+            opts->arenas = number;
+        } else if (OPTION_IS("cache_idle_ms")) {
+            opts->cache_idle_ms = number;
+        } else if (OPTION_IS("prefault")) {
+            opts->prefault = number != 0;
+        } else if (OPTION_IS("grow")) {
+            opts->grow_policy = VALUE_IS("geometric") ? MLOCK_GROW_GEOMETRIC
+                                                      : MLOCK_GROW_FIXED;
+        } else if (OPTION_IS("fit")) {
+            opts->fit_policy
+                = VALUE_IS("best") ? MLOCK_FIT_BEST : MLOCK_FIT_FIRST;
+        } else if (OPTION_IS("order")) {
+            opts->order_policy
+                = VALUE_IS("address") ? MLOCK_ORDER_ADDRESS : MLOCK_ORDER_LIFO;
+        } else {
+            DEBUG("Ignoring unknown option at %s", env);
+        }
+
+#undef OPTION_IS
+#undef VALUE_IS
+
+        env = *end ? end + 1 : end;
+    }
+}
+
+static void prefault(byte_t* start, size_t size)
+{
+    DEBUG("Prefaulting %ld bytes at %p", size, start);
+
+    byte_t* page = (byte_t*)(GET_PAGE(start) << PAGE_SHIFT);
+    size = ALIGN_PAGES(start + size - page);
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(page, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+
+    // Fall back to touching each page; adding zero keeps any data intact
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        if (page + offset < start) {
+            continue;
+        }
+        __atomic_fetch_add(page + offset, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static size_t grow_size(heap_t* heap, size_t size)
+{
+    size_t grow = options.chunk_size;
+
+    if (options.grow_policy == MLOCK_GROW_GEOMETRIC) {
+        grow = MAX(grow, heap->size);
+    }
+
+    return MAX(size, grow);
+}
+
+static size_t heap_bytes(void)
+{
+    size_t bytes = 0;
+
+    for (arena_t* arena = arenas; arena < arenas + arena_count; arena++) {
+        for (int i = 0; i < NUM_HEAPS; i++) {
+            bytes += __atomic_load_n(&arena->heaps[i].size, __ATOMIC_RELAXED);
+        }
+    }
+
+    return bytes;
+}
+
+static void tag_account(int tag, long bytes, long count)
+{
+    register_thread();
+    thread_tag_bytes[tag] += bytes;
+    thread_tag_count[tag] += count;
+
+    if (thread_tag_bytes[tag] >= TAG_BATCH
+        || thread_tag_bytes[tag] <= -TAG_BATCH) {
+        tag_publish(tag);
+    }
+}
+
+static void tag_publish(int tag)
+{
+    long bytes = __atomic_add_fetch(
+        &tag_bytes[tag], thread_tag_bytes[tag], __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tag_count[tag], thread_tag_count[tag],
+        __ATOMIC_RELAXED);
+    thread_tag_bytes[tag] = 0;
+    thread_tag_count[tag] = 0;
+
+    const tag_limit_t* limit
+        = __atomic_load_n(&tag_limits[tag], __ATOMIC_ACQUIRE);
+
+    if (limit == NULL) {
+        return;
+    }
+
+    int over = bytes > 0 && (size_t)bytes > limit->bytes;
+
+    // Only the thread that flips the flag upward runs the callback
+    if (__atomic_exchange_n(&tag_over_limit[tag], over, __ATOMIC_RELAXED)
+            == 0
+        && over && limit->fn != NULL) {
+        DEBUG("Tag %d is over its soft limit with %ld bytes", tag, bytes);
+        limit->fn(tag, bytes, limit->arg);
+    }
+}
+
+static word_t now_ms(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (word_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+static void purge_tick(void)
+{
+    if (__atomic_add_fetch(&purge_ticks, 1, __ATOMIC_RELAXED) % PURGE_TICKS
+        != 0) {
+        return;
+    }
+
+    word_t now = now_ms();
+
+    // Only the thread that moves last_purge or last_scavenge forward acts
+    if (options.decay_ms) {
+        word_t last = __atomic_load_n(&last_purge, __ATOMIC_RELAXED);
+
+        if (now - last >= options.decay_ms / 4
+            && __atomic_compare_exchange_n(&last_purge, &last, now, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            purge_idle(options.decay_ms);
+        }
+    }
+
+    if (options.cache_idle_ms) {
+        word_t last = __atomic_load_n(&last_scavenge, __ATOMIC_RELAXED);
+
+        if (now - last >= options.cache_idle_ms / 2
+            && __atomic_compare_exchange_n(&last_scavenge, &last, now, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            scavenge_caches(now, options.cache_idle_ms);
+        }
+    }
+}
+
+static size_t purge_idle(word_t idle_ms)
+{
+    word_t now = now_ms();
+    size_t purged = 0;
+
+    for (arena_t* arena = arenas; arena < arenas + arena_count; arena++) {
+        if (!__atomic_load_n(&arena->ready, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        for (int i = 0; i < NUM_HEAPS; i++) {
+            purged += purge_heap(&arena->heaps[i], now, idle_ms);
+        }
+    }
+
+    return purged;
+}
+
+static size_t purge_heap(heap_t* heap, word_t now, word_t idle_ms)
+{
+    size_t purged = 0;
+
+    for (int bin = SIZE_BIN(PURGE_MIN); bin < NUM_BINS; bin++) {
+        // Held across madvise so no block is handed out mid-purge
+        heap_lock(&heap->bin_locks[bin]);
+        byte_t* fp = heap->free_lists[bin];
+
+        for (; fp != NULL; fp = GET_NEXT_FREE(fp)) {
+            word_t freed_at = GET_FREED_AT(fp);
+
+            if (freed_at == 0 || now - freed_at < idle_ms) {
+                continue;
+            }
+
+            // Keep the pages holding the free list words and boundary tag
+            byte_t* start = (byte_t*)ALIGN_PAGES((word_t)fp + WORD_SIZE * 4);
+            byte_t* end = (byte_t*)(GET_PAGE(GET_BOUNDARY(fp)) << PAGE_SHIFT);
+
+            if (end > start
+                && madvise(start, end - start, MADV_DONTNEED) == 0) {
+                DEBUG("Purged %ld idle bytes at %p", end - start, start);
+                purged += end - start;
+            }
+
+            PUT_FREED_AT(fp, 0);
+        }
+
+        heap_unlock(&heap->bin_locks[bin]);
+    }
+
+    return purged;
+}
+
+static const mlock_hooks_t* should_sample(size_t size)
+{
+    const mlock_hooks_t* active = __atomic_load_n(&hooks, __ATOMIC_ACQUIRE);
+
+    if (active == NULL || in_hook
+        || (!active->on_alloc && !active->on_free && !active->on_realloc)) {
+        return NULL;
+    }
+
+    if (active->sample_interval == 0) {
+        return active;
+    }
+
+    sample_countdown -= size;
+
+    if (sample_countdown > 0) {
+        return NULL;
+    }
+
+    // Jitter the next interval so periodic patterns aren't always sampled
+    // at the same point
+    sample_seed = sample_seed * 1103515245 + 12345;
+    sample_countdown = active->sample_interval / 2
+        + (sample_seed >> 8) % (active->sample_interval + 1);
+    return active;
+}
+
+static void register_thread(void)
+{
+    if (!thread_registered) {
+        thread_registered = 1;
+        pthread_once(&thread_key_once, make_thread_key);
+        pthread_setspecific(thread_key, &thread_registered);
+    }
+}
+
+static void thread_exit(void* arg)
+{
+    (void)arg;
+
+    for (int tag = 1; tag < MLOCK_MAX_TAGS; tag++) {
+        if (thread_tag_bytes[tag] || thread_tag_count[tag]) {
+            tag_publish(tag);
+        }
+    }
+
+    for (int i = 0; i < POOL_CACHES; i++) {
+        pool_flush(&pool_caches[i], pool_caches[i].count);
+    }
+
+    // Blocks the thread deferred may still be read by others, so they wait
+    // with the orphans
+    epoch_record_t* record = &epoch_record;
+    lock_meta();
+
+    if (record->state == THREAD_LIVE) {
+        for (int i = 0; i < 3; i++) {
+            while (record->limbo[i] != NULL) {
+                bag_t* bag = record->limbo[i];
+                record->limbo[i] = bag->next;
+                bag->next = orphan_bags;
+                orphan_bags = bag;
+            }
+        }
+
+        if (record->prev != NULL) {
+            record->prev->next = record->next;
+        } else {
+            live_records = record->next;
+        }
+
+        if (record->next != NULL) {
+            record->next->prev = record->prev;
+        }
+    }
+
+    record->state = THREAD_DEAD;
+    unlock_meta();
+
+    thread_cache_t* cache = &thread_cache;
+
+    if (cache->state != THREAD_LIVE) {
+        cache->state = THREAD_DEAD;
+        return;
+    }
+
+    // Blocks freed by destructors that run after this one bypass the cache
+    pthread_mutex_lock(&cache->lock);
+    byte_t* chain = empty_cache(cache, NULL);
+    cache->state = THREAD_DEAD;
+    pthread_mutex_unlock(&cache->lock);
+
+    lock_meta();
+
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else {
+        live_caches = cache->next;
+    }
+
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+
+    unlock_meta();
+    pthread_mutex_destroy(&cache->lock);
+    free_cached(chain);
+}
+
+static void make_thread_key(void)
+{
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+static void heap_lock(heap_lock_t* lock)
+{
+    int state = LOCK_FREE;
+
+    if (__atomic_compare_exchange_n(&lock->state, &state, LOCK_HELD, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    __atomic_add_fetch(&lock_contended, 1, __ATOMIC_RELAXED);
+    int backoff = 1;
+
+    // Critical sections are a few free list updates, far shorter than a trip
+    // through the kernel
+    for (int i = 0; i < lock_spins; i++) {
+        for (int j = 0; j < backoff; j++) {
+            CPU_RELAX();
+        }
+
+        backoff = MIN(backoff * 2, LOCK_BACKOFF);
+        state = LOCK_FREE;
+
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == LOCK_FREE
+            && __atomic_compare_exchange_n(&lock->state, &state, LOCK_HELD, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&lock_spun, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    // Marking the lock waited on makes its holder wake a sleeper; a thread
+    // that takes it this way can't tell whether others still sleep, so keeps
+    // the mark
+    while (__atomic_exchange_n(&lock->state, LOCK_WAITED, __ATOMIC_ACQUIRE)
+        != LOCK_FREE) {
+        __atomic_add_fetch(&lock_parked, 1, __ATOMIC_RELAXED);
+#ifdef __linux__
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, LOCK_WAITED, NULL,
+            NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+static void heap_unlock(heap_lock_t* lock)
+{
+    if (__atomic_exchange_n(&lock->state, LOCK_FREE, __ATOMIC_RELEASE)
+        == LOCK_WAITED) {
+#ifdef __linux__
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
+
+static void lock_meta(void)
+{
+    pthread_once(&meta_lock_once, make_meta_lock);
+    pthread_mutex_lock(&meta_lock);
+}
+
+static void unlock_meta(void)
+{
+    pthread_mutex_unlock(&meta_lock);
+}
+
+static void make_meta_lock(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&meta_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void ready_arena(arena_t* arena)
+{
+    if (arena->ready) {
+        return;
+    }
+
+    // Heap locks start out unlocked as zero
+    for (int i = 0; i < NUM_HEAPS; i++) {
+        heap_t* heap = &arena->heaps[i];
+        heap->arena = arena;
+        heap->release = i == MLOCK_HINT_SHORT;
+    }
+
+    __atomic_store_n(&arena->ready, 1, __ATOMIC_RELEASE);
+}
+
+static arena_t* pick_arena(void)
+{
+    if (locked_arena != NULL) {
+        return locked_arena;
+    }
+
+    if (thread_arena != NULL) {
+        return thread_arena;
+    }
+
+    lock_meta();
+
+    if (heap_span != NULL || init_lock() != NULL) {
+        thread_arena = &arenas[next_arena++ % arena_count];
+        ready_arena(thread_arena);
+        DEBUG("Thread got arena %ld", thread_arena - arenas);
+    }
+
+    unlock_meta();
+    return thread_arena;
+}
+
+static void lock_arena(arena_t* arena)
+{
+    // Nested calls must be for the arena already held; callers check
+    // locked_arena before locking any other
+    if (locked_depth++ > 0) {
+        assert(locked_arena == arena);
+        return;
+    }
+
+    heap_lock(&arena->lock);
+    locked_arena = arena;
+
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    byte_t* bp = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (bp != NULL) {
+        byte_t* next = (byte_t*)GET_WORD(bp);
+        free_block(pagemap_get(bp)->owner, bp);
+        bp = next;
+    }
+}
+
+static void unlock_arena(arena_t* arena)
+{
+    if (--locked_depth == 0) {
+        locked_arena = NULL;
+        heap_unlock(&arena->lock);
+    }
+}
+
+static void free_to_arena(heap_t* heap, byte_t* bp)
+{
+    arena_t* arena = heap->arena;
+
+    if (locked_arena == NULL || locked_arena == arena) {
+        lock_arena(arena);
+        free_block(heap, bp);
+        unlock_arena(arena);
+        return;
+    }
+
+    // Waiting on a second arena's lock could deadlock with a thread that
+    // holds it and waits on ours
+    DEBUG("Leaving block %p for its arena", bp);
+    byte_t* head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+
+    do {
+        PUT_WORD(bp, head);
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, bp, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static byte_t* alloc_fast(heap_t* heap, size_t size)
+{
+#ifdef MLOCK_ENABLE_FREE_INDEX
+    // The index is shared by every bin
+    (void)heap;
+    (void)size;
+    return NULL;
+#else
+    size = ALIGN_BYTES(size);
+    size = MAX(size, MIN_DATA_SIZE);
+    int bin = SIZE_BIN(size);
+
+    // Coloring splits padding off the block
+    if ((options.color_threshold && size >= options.color_threshold)
+        || !(__atomic_load_n(&heap->bins_used, __ATOMIC_ACQUIRE)
+            & (1ULL << bin))) {
+        return NULL;
+    }
+
+    byte_t* bp = NULL;
+    heap_lock(&heap->bin_locks[bin]);
+    byte_t* fp = heap->free_lists[bin];
+
+    for (int i = 0; fp != NULL && i < FAST_SCAN; i++) {
+        word_t fp_size = GET_SIZE(fp);
+
+        // Splitting would make a free block next to one that may be
+        // coalescing
+        if (fp_size >= size && fp_size - size < options.split_threshold) {
+            unlink_free_block(heap, fp);
+            REDO_HEADERS(fp, fp_size, ALLOCATED);
+            bp = fp;
+            break;
+        }
+
+        fp = GET_NEXT_FREE(fp);
+    }
+
+    heap_unlock(&heap->bin_locks[bin]);
+    DEBUG("Took block %p without the arena lock", bp);
+    return bp;
+#endif
+}
+
+
+static thread_cache_t* get_cache(void)
+{
+    thread_cache_t* cache = &thread_cache;
+
+    if (cache->state != THREAD_UNUSED) {
+        return cache->state == THREAD_LIVE ? cache : NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    for (int i = 0; i < CACHE_CLASSES; i++) {
+        cache->classes[i].limit = CACHE_START;
+    }
+
+    lock_meta();
+    cache->prev = NULL;
+    cache->next = live_caches;
+
+    if (live_caches != NULL) {
+        live_caches->prev = cache;
+    }
+
+    live_caches = cache;
+    unlock_meta();
+    cache->state = THREAD_LIVE;
+    register_thread();
+    return cache;
+}
+
+static byte_t* cache_alloc(arena_t* arena, heap_t* heap, size_t size)
+{
+    size = ALIGN_BYTES(size);
+    size = MAX(size, MIN_DATA_SIZE);
+
+    // Blocks allocated under an arena's lock, such as by hooks, skip the
+    // cache, which may have to take that lock
+    if (size > CACHE_MAX_SIZE || locked_arena != NULL
+        || (options.color_threshold && size >= options.color_threshold)) {
+        return NULL;
+    }
+
+    thread_cache_t* cache = get_cache();
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache_class_t* cls = &cache->classes[size / 8];
+    pthread_mutex_lock(&cache->lock);
+    __atomic_store_n(&cache->ticks, cache->ticks + 1, __ATOMIC_RELAXED);
+    byte_t* bp = cls->head;
+
+    if (bp != NULL) {
+        cls->head = (byte_t*)GET_WORD(bp);
+        cls->count--;
+        pthread_mutex_unlock(&cache->lock);
+        return bp;
+    }
+
+    cls->misses++;
+    cache_adapt(cls, size);
+    unsigned batch = MAX(cls->limit / 2, 1);
+    pthread_mutex_unlock(&cache->lock);
+
+    // Refilling may run reclaim callbacks, which may use the cache
+    // themselves, so the batch is only spliced in once it's taken
+    byte_t* tail;
+    unsigned count;
+    bp = cache_refill(arena, heap, size, batch, &tail, &count);
+
+    if (bp == NULL || count == 1) {
+        return bp;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    PUT_WORD(tail, cls->head);
+    cls->head = (byte_t*)GET_WORD(bp);
+    cls->count += count - 1;
+    pthread_mutex_unlock(&cache->lock);
+    return bp;
+}
+
+static int cache_free(heap_t* heap, byte_t* bp)
+{
+    word_t size = GET_SIZE(bp);
+
+    // Blocks of short-lived heaps would keep their segments from draining
+    if (heap->release || size > CACHE_MAX_SIZE || locked_arena != NULL) {
+        return -1;
+    }
+
+    thread_cache_t* cache = get_cache();
+
+    if (cache == NULL) {
+        return -1;
+    }
+
+    cache_class_t* cls = &cache->classes[size / 8];
+    pthread_mutex_lock(&cache->lock);
+    __atomic_store_n(&cache->ticks, cache->ticks + 1, __ATOMIC_RELAXED);
+
+    // The next allocation samples and tracks the block afresh
+    PUT_WORD(GET_HEADER(bp), PACK_HEADER(size, ALLOCATED));
+    PUT_WORD(bp, cls->head);
+    cls->head = bp;
+
+    if (++cls->count > cls->limit) {
+        transfer_t* transfer = thread_arena != NULL
+            ? &thread_arena->transfers[size / 8]
+            : NULL;
+        cls->overflows++;
+        cache_adapt(cls, size);
+        cache_flush(cls, transfer, MAX(cls->limit / 2, 1));
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+static void cache_adapt(cache_class_t* cls, size_t size)
+{
+    if (cls->misses + cls->overflows < CACHE_ADAPT) {
+        return;
+    }
+
+    // A class that runs dry as often as it overflows is cycling through more
+    // blocks than it holds; one that mostly overflows is only hoarding what
+    // the thread frees for others
+    if (cls->misses >= cls->overflows) {
+        unsigned most = MIN(CACHE_MAX_LIMIT, CACHE_MAX_BYTES / size);
+        cls->limit = MIN(cls->limit * 2, most);
+    } else {
+        cls->limit = MAX(cls->limit / 2, CACHE_MIN_LIMIT);
+    }
+
+    DEBUG("Cache class of %ld bytes now holds %d blocks", size, cls->limit);
+    cls->misses = 0;
+    cls->overflows = 0;
+}
+
+static byte_t* cache_refill(arena_t* arena, heap_t* heap, size_t size,
+    unsigned batch, byte_t** tail, unsigned* count)
+{
+    // Another thread's flush saves taking the arena's lock at all
+    byte_t* head = transfer_take(&arena->transfers[size / 8], tail, count);
+
+    if (head != NULL) {
+        return head;
+    }
+
+    *count = 0;
+    lock_arena(arena);
+
+    while (*count < batch) {
+        byte_t* bp = alloc_block(heap, size);
+
+        if (bp == NULL) {
+            break;
+        }
+
+        if (head == NULL) {
+            *tail = bp;
+        }
+
+        PUT_WORD(bp, head);
+        head = bp;
+        (*count)++;
+    }
+
+    unlock_arena(arena);
+    return head;
+}
+
+static void cache_flush(cache_class_t* cls, transfer_t* transfer,
+    unsigned keep)
+{
+    byte_t* last = cls->head;
+
+    for (unsigned i = 1; i < keep; i++) {
+        last = (byte_t*)GET_WORD(last);
+    }
+
+    byte_t* chain = (byte_t*)GET_WORD(last);
+    PUT_WORD(last, NULL);
+    cls->count = keep;
+
+    if (transfer == NULL || transfer_put(transfer, chain) == -1) {
+        free_cached(chain);
+    }
+}
+
+static byte_t* transfer_take(transfer_t* transfer, byte_t** tail,
+    unsigned* count)
+{
+    uint64_t top = __atomic_load_n(&transfer->top, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    byte_t* bp;
+
+    do {
+        bp = STACK_TOP(top);
+
+        if (bp == NULL) {
+            return NULL;
+        }
+
+        // Another thread may have popped the batch and be using its blocks;
+        // long-lived heaps stay mapped, so the read is harmless, and the
+        // version has moved on, so the swap fails
+        next = PACK_STACK(GET_NEXT_BATCH(bp), STACK_VERSION(top) + 1);
+    } while (!__atomic_compare_exchange_n(&transfer->top, &top, next, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    __atomic_sub_fetch(&transfer->batches, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&transfer->touched, 1, __ATOMIC_RELAXED);
+    *count = 1;
+    *tail = bp;
+
+    while (GET_WORD(*tail) != 0) {
+        *tail = (byte_t*)GET_WORD(*tail);
+        (*count)++;
+    }
+
+    return bp;
+}
+
+static int transfer_put(transfer_t* transfer, byte_t* bp)
+{
+    if (__atomic_add_fetch(&transfer->batches, 1, __ATOMIC_RELAXED)
+        > TRANSFER_SLOTS) {
+        __atomic_sub_fetch(&transfer->batches, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    uint64_t top = __atomic_load_n(&transfer->top, __ATOMIC_RELAXED);
+
+    do {
+        PUT_NEXT_BATCH(bp, STACK_TOP(top));
+    } while (!__atomic_compare_exchange_n(&transfer->top, &top,
+        PACK_STACK(bp, STACK_VERSION(top) + 1), 0, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED));
+
+    __atomic_store_n(&transfer->touched, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static byte_t* drain_transfer(transfer_t* transfer, byte_t* chain, int all)
+{
+    if (__atomic_exchange_n(&transfer->touched, 0, __ATOMIC_RELAXED) && !all) {
+        return chain;
+    }
+
+    // Taking the whole stack at once can't be fooled by a batch coming back
+    uint64_t top = __atomic_load_n(&transfer->top, __ATOMIC_ACQUIRE);
+
+    while (STACK_TOP(top) != NULL
+        && !__atomic_compare_exchange_n(&transfer->top, &top,
+            PACK_STACK(NULL, STACK_VERSION(top) + 1), 0, __ATOMIC_ACQUIRE,
+            __ATOMIC_ACQUIRE)) {
+    }
+
+    for (byte_t* batch = STACK_TOP(top); batch != NULL;) {
+        byte_t* next = GET_NEXT_BATCH(batch);
+        byte_t* last = batch;
+
+        while (GET_WORD(last) != 0) {
+            last = (byte_t*)GET_WORD(last);
+        }
+
+        PUT_WORD(last, chain);
+        chain = batch;
+        batch = next;
+        __atomic_sub_fetch(&transfer->batches, 1, __ATOMIC_RELAXED);
+    }
+
+    return chain;
+}
+
+static byte_t* empty_cache(thread_cache_t* cache, byte_t* chain)
+{
+    for (int i = 0; i < CACHE_CLASSES; i++) {
+        cache_class_t* cls = &cache->classes[i];
+
+        while (cls->head != NULL) {
+            byte_t* bp = cls->head;
+            cls->head = (byte_t*)GET_WORD(bp);
+            PUT_WORD(bp, chain);
+            chain = bp;
+        }
+
+        cls->count = 0;
+        cls->limit = CACHE_START;
+        cls->misses = 0;
+        cls->overflows = 0;
+    }
+
+    return chain;
+}
+
+static void free_cached(byte_t* bp)
+{
+    // Under one arena's lock, blocks of the others are left on their remote
+    // lists rather than each taking its arena's lock in turn
+    arena_t* arena = locked_arena != NULL ? locked_arena : thread_arena;
+
+    if (arena != NULL) {
+        lock_arena(arena);
+    }
+
+    while (bp != NULL) {
+        byte_t* next = (byte_t*)GET_WORD(bp);
+        span_t* span = pagemap_get(bp);
+        free_to_arena(span->owner, bp);
+        bp = next;
+    }
+
+    if (arena != NULL) {
+        unlock_arena(arena);
+    }
+}
+
+static void scavenge_caches(word_t now, word_t idle_ms)
+{
+    byte_t* chain = NULL;
+    lock_meta();
+
+    for (thread_cache_t* cache = live_caches; cache != NULL;
+         cache = cache->next) {
+        unsigned ticks = __atomic_load_n(&cache->ticks, __ATOMIC_RELAXED);
+
+        if (ticks != cache->seen_ticks) {
+            cache->seen_ticks = ticks;
+            cache->idle_since = now;
+
+            if (idle_ms != 0) {
+                continue;
+            }
+        }
+
+        // A cache whose lock is taken is in use by its thread
+        if (now - cache->idle_since < idle_ms
+            || pthread_mutex_trylock(&cache->lock) != 0) {
+            continue;
+        }
+
+        chain = empty_cache(cache, chain);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    unlock_meta();
+
+    for (arena_t* arena = arenas; arena < arenas + arena_count; arena++) {
+        if (__atomic_load_n(&arena->ready, __ATOMIC_ACQUIRE)) {
+            for (int i = 0; i < CACHE_CLASSES; i++) {
+                chain = drain_transfer(&arena->transfers[i], chain,
+                    idle_ms == 0);
+            }
+        }
+    }
+
+    if (chain != NULL) {
+        DEBUG("Scavenging blocks of caches idle for %ld ms", idle_ms);
+        free_cached(chain);
+    }
+}
+
+static epoch_record_t* get_epoch_record(void)
+{
+    epoch_record_t* record = &epoch_record;
+
+    if (record->state != THREAD_UNUSED) {
+        return record->state == THREAD_LIVE ? record : NULL;
+    }
+
+    lock_meta();
+    record->prev = NULL;
+    record->next = live_records;
+
+    if (live_records != NULL) {
+        live_records->prev = record;
+    }
+
+    live_records = record;
+    unlock_meta();
+    record->state = THREAD_LIVE;
+    register_thread();
+    return record;
+}
+
+static int defer_block(bag_t** bags, void* ptr, word_t epoch)
+{
+    bag_t* bag = *bags;
+
+    if (bag == NULL || bag->epoch != epoch || bag->count == EPOCH_BAG_SIZE) {
+        lock_meta();
+        bag = free_bags;
+
+        if (bag != NULL) {
+            free_bags = bag->next;
+        } else {
+            bag = meta_alloc(sizeof(bag_t));
+        }
+
+        unlock_meta();
+
+        if (bag == NULL) {
+            return -1;
+        }
+
+        bag->next = *bags;
+        bag->epoch = epoch;
+        bag->count = 0;
+        *bags = bag;
+    }
+
+    bag->ptrs[bag->count++] = ptr;
+    return 0;
+}
+
+static void release_bags(bag_t* bag)
+{
+    if (bag == NULL) {
+        return;
+    }
+
+    bag_t* last = bag;
+
+    for (bag_t* each = bag; each != NULL; each = each->next) {
+        for (unsigned i = 0; i < each->count; i++) {
+            unlock(each->ptrs[i]);
+        }
+
+        last = each;
+    }
+
+    lock_meta();
+    last->next = free_bags;
+    free_bags = bag;
+    unlock_meta();
+}
+
+static void epoch_collect(epoch_record_t* record, word_t epoch)
+{
+    record->seen = epoch;
+
+    for (int i = 0; i < 3; i++) {
+        bag_t* bag = record->limbo[i];
+
+        // Bags of one slot share an epoch, as older ones are freed before
+        // the slot comes around again
+        if (bag != NULL && bag->epoch + 2 <= epoch) {
+            record->limbo[i] = NULL;
+            release_bags(bag);
+        }
+    }
+}
+
+static word_t epoch_advance(void)
+{
+    bag_t* expired = NULL;
+    lock_meta();
+    word_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    int quiet = 1;
+
+    // Pairs with the fence after a thread pins an epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (epoch_record_t* record = live_records; record != NULL && quiet;
+         record = record->next) {
+        word_t pinned = __atomic_load_n(&record->pinned, __ATOMIC_ACQUIRE);
+        quiet = !(pinned & 1) || pinned >> 1 == epoch;
+    }
+
+    if (quiet) {
+        __atomic_store_n(&global_epoch, ++epoch, __ATOMIC_RELEASE);
+    }
+
+    bag_t** link = &orphan_bags;
+
+    while (*link != NULL) {
+        bag_t* bag = *link;
+
+        if (bag->epoch + 2 <= epoch) {
+            *link = bag->next;
+            bag->next = expired;
+            expired = bag;
+        } else {
+            link = &bag->next;
+        }
+    }
+
+    unlock_meta();
+    release_bags(expired);
+    return epoch;
+}
+
+void unlock(void* ptr)
+{
+    DEBUG("Freeing pointer %p", ptr);
+
+    span_t* span = pagemap_get(ptr);
+
+    // The sbrk segment may be growing in another thread
+    if (span == NULL || (byte_t*)ptr < span->start
+        || (byte_t*)ptr
+            >= span->start + __atomic_load_n(&span->size, __ATOMIC_RELAXED)) {
+        DEBUG("Pointer %p isn't managed by m-lock", ptr);
+        return;
+    }
+
+    TRACE(unlock, ptr, span->kind);
+
+    switch (span->kind) {
+    case SPAN_HEAP: {
+        byte_t* bp = IS_TAGGED(ptr) ? (byte_t*)ptr - TAG_SIZE : ptr;
+
+        const mlock_hooks_t* active = IS_SAMPLED(bp) && !in_hook
+            ? __atomic_load_n(&hooks, __ATOMIC_ACQUIRE)
+            : NULL;
+
+        if (active != NULL && active->on_free != NULL) {
+            in_hook = 1;
+            active->on_free(
+                ptr, GET_SIZE(bp) - ((byte_t*)ptr - bp), active->arg);
+            in_hook = 0;
+        }
+
+        if (bp != ptr) {
+            tag_account(GET_TAG(ptr), -(long)GET_SIZE(bp), -1);
+        }
+
+        if (IS_TRACKED(bp)) {
+            lock_meta();
+            untrack_block(bp, 1);
+            unlock_meta();
+        }
+
+        if (cache_free(span->owner, bp) == -1) {
+            free_to_arena(span->owner, bp);
+        }
+
+        purge_tick();
+        break;
+    }
+    case SPAN_SLAB:
+        mlock_pool_free(span->owner, ptr);
+        break;
+    case SPAN_IOBUF:
+        mlock_iobuf_free(span->owner, ptr);
+        break;
+    case SPAN_RING:
+        unlock_ring(ptr);
+        break;
+    default:
+        DEBUG("Pointer %p is in a span of unknown kind %d", ptr, span->kind);
+        break;
+    }
+}
+
+void mlock_epoch_enter(void)
+{
+    epoch_record_t* record = get_epoch_record();
+
+    if (record == NULL || record->depth++ > 0) {
+        return;
+    }
+
+    // The pin must be visible before the section reads anything, or a thread
+    // advancing the epoch could miss it
+    word_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->pinned, epoch << 1 | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void mlock_epoch_exit(void)
+{
+    epoch_record_t* record = get_epoch_record();
+
+    if (record == NULL || record->depth == 0 || --record->depth > 0) {
+        return;
+    }
+
+    __atomic_store_n(&record->pinned, 0, __ATOMIC_RELEASE);
+    word_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    if (epoch != record->seen) {
+        epoch_collect(record, epoch);
+    }
+}
+
+void unlock_deferred(void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    epoch_record_t* record = get_epoch_record();
+
+    // The caller's unlinking must be visible before the epoch is read, or a
+    // reader pinned at the next epoch could still find the block after this
+    // bag's epoch has been retired
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    word_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+
+    if (record == NULL) {
+        // The thread is exiting; leave the block with the orphans
+        lock_meta();
+        int deferred = defer_block(&orphan_bags, ptr, epoch);
+        unlock_meta();
+
+        if (deferred == -1) {
+            DEBUG("Leaking %p, as no bag could be allocated for it", ptr);
+        }
+
+        return;
+    }
+
+    if (epoch != record->seen) {
+        epoch_collect(record, epoch);
+    }
+
+    if (defer_block(&record->limbo[epoch % 3], ptr, epoch) == -1) {
+        DEBUG("Leaking %p, as no bag could be allocated for it", ptr);
+        return;
+    }
+
+    if (++record->deferred % EPOCH_INTERVAL == 0) {
+        epoch_collect(record, epoch_advance());
+    }
+}
+
+static void free_block(heap_t* heap, byte_t* ptr)
+{
+    word_t size = GET_SIZE(ptr);
+    REDO_HEADERS(ptr, size, FREE);
+
+    if (GET_PREV_ALLOC(ptr) == FREE
+        && remove_free_block(heap, GET_PREV_BLOCK(ptr)) == 0) {
+        // Coalesce with previous
+        DEBUG("Coalescing with prev");
+        TRACE(coalesce, ptr, GET_PREV_BLOCK(ptr), size);
+        ptr = GET_PREV_BLOCK(ptr);
+        DEBUG("Prev pointer %p", ptr);
+        size += GET_SIZE(ptr) + BOUNDARY_SIZE + HEADER_SIZE;
+        REDO_HEADERS(ptr, size, FREE);
+    }
+
+    byte_t* next_header = GET_NEXT_HEADER(ptr);
+
+    if (GET_ALLOC_FROM_HEADER(next_header) == FREE
+        && remove_free_block(heap, next_header + HEADER_SIZE) == 0) {
+        // Coalesce with next
+        DEBUG("Coalescing with next");
+        DEBUG("Next header %p", next_header);
+        TRACE(coalesce, ptr, next_header + HEADER_SIZE, size);
+        size
+            += GET_SIZE_FROM_HEADER(next_header) + BOUNDARY_SIZE + HEADER_SIZE;
+        REDO_HEADERS(ptr, size, FREE);
+    }
+
+    // Keep the heap's last segment so the next allocations can reuse it
+    if (heap->release && IS_DRAINED(ptr)
+        && heap->size > size + WORD_SIZE * 6) {
+        release_segment(heap, ptr);
+        return;
+    }
+
+    if (size >= PURGE_MIN) {
+        PUT_FREED_AT(ptr, now_ms());
+    }
+
+    insert_free_block(heap, ptr);
+    DEBUG("Finished freeing block %p", ptr);
+}
+
+void* relock(void* ptr, size_t size)
+{
+    DEBUG("Reallocating pointer %p to size %ld", ptr, size);
+
+    if (ptr == NULL) {
+        DEBUG("Making new pointer");
+        return alloc_user(size, thread_tag, HINT_NONE,
+            __builtin_return_address(0));
+    }
+
+    if (size <= 0) {
+        DEBUG("Freeing pointer %p", ptr);
+        unlock(ptr);
+        return NULL;
+    }
+
+    return resize(ptr, size, 0, __builtin_return_address(0));
+}
+
+void* relock_inplace(void* ptr, size_t size)
+{
+    DEBUG("Resizing pointer %p in place to size %ld", ptr, size);
+
+    if (ptr == NULL || size <= 0) {
+        return NULL;
+    }
+
+    return resize(ptr, size, 1, __builtin_return_address(0));
+}
+
+static void* resize(void* ptr, size_t size, int in_place, void* site)
+{
+    span_t* span = pagemap_get(ptr);
+
+    if (span == NULL) {
+        DEBUG("Can't resize %p, which m-lock doesn't manage", ptr);
+        return NULL;
+    }
+
+    if (span->kind != SPAN_HEAP) {
+        // Pool objects, I/O buffers and rings have the sizes they were made
+        // with
+        DEBUG("Can't resize %p, which isn't a heap block but of span kind %d",
+            ptr, span->kind);
+        return NULL;
+    }
+
+    heap_t* heap = span->owner;
+    byte_t* new_ptr;
+    byte_t* old_bp = IS_TAGGED(ptr) ? (byte_t*)ptr - TAG_SIZE : ptr;
+    int sampled = IS_SAMPLED(old_bp);
+
+    // A resized block's lifetime no longer says much about its site
+    if (IS_TRACKED(old_bp)) {
+        lock_meta();
+        untrack_block(old_bp, 0);
+        unlock_meta();
+    }
+
+    if (locked_arena != NULL && locked_arena != heap->arena) {
+        // Waiting on the block's arena could deadlock; move the block into
+        // the arena held instead
+        if (in_place) {
+            return NULL;
+        }
+
+        new_ptr = move_user(ptr, size, site);
+    } else {
+        new_ptr = resize_user(heap, ptr, size, in_place);
+    }
+
+    if (new_ptr != NULL && sampled) {
+        // Moving or resizing redid the headers, which dropped the mark
+        MARK_SAMPLED(IS_TAGGED(new_ptr) ? new_ptr - TAG_SIZE : new_ptr);
+    }
+
+    TRACE(relock, ptr, new_ptr, size);
+
+    const mlock_hooks_t* active = new_ptr != NULL && sampled && !in_hook
+        ? __atomic_load_n(&hooks, __ATOMIC_ACQUIRE)
+        : NULL;
+
+    if (active != NULL && active->on_realloc != NULL) {
+        in_hook = 1;
+        active->on_realloc(ptr, new_ptr, size, active->arg);
+        in_hook = 0;
+    }
+
+    return new_ptr;
+}
+
+static void* move_user(void* ptr, size_t size, void* site)
+{
+    byte_t* old_bp = IS_TAGGED(ptr) ? (byte_t*)ptr - TAG_SIZE : ptr;
+    size_t old_size = GET_SIZE(old_bp) - ((byte_t*)ptr - old_bp);
+
+    // The move is reported as one resize, not as an allocation and a free
+    int old_in_hook = in_hook;
+    in_hook = 1;
+    byte_t* new_ptr = alloc_user(size, IS_TAGGED(ptr) ? GET_TAG(ptr) : 0,
+        HINT_NONE, site);
+
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        unlock(ptr);
+    }
+
+    in_hook = old_in_hook;
+    return new_ptr;
+}
+
+static void* resize_user(heap_t* heap, void* ptr, size_t size, int in_place)
+{
+    byte_t* new_ptr;
+    lock_arena(heap->arena);
+
+    if (IS_TAGGED(ptr)) {
+        byte_t* bp = (byte_t*)ptr - TAG_SIZE;
+        word_t old_size = GET_SIZE(bp);
+
+        // The tag word moves along with the rest of the block's data
+        if (in_place) {
+            bp = resize_block(heap, bp, size + TAG_SIZE) == 0 ? bp : NULL;
+        } else {
+            bp = realloc_block(heap, bp, size + TAG_SIZE);
+        }
+        new_ptr = bp ? bp + TAG_SIZE : NULL;
+
+        if (bp != NULL) {
+            tag_account(GET_TAG(new_ptr),
+                (long)GET_SIZE(bp) - (long)old_size, 0);
+        }
+    } else if (in_place) {
+        new_ptr = resize_block(heap, ptr, size) == 0 ? ptr : NULL;
+    } else {
+        new_ptr = realloc_block(heap, ptr, size);
+    }
+
+    unlock_arena(heap->arena);
+    return new_ptr;
+}
+
+static byte_t* realloc_block(heap_t* heap, byte_t* ptr, size_t size)
+{
+    if (resize_block(heap, ptr, size) == 0) {
         return ptr;
     }
 
-    size_t needed = size - current_size;
-    byte_t* next_bp = GET_NEXT_BLOCK(ptr);
-    size_t gained_in_merge = BOUNDARY_SIZE + HEADER_SIZE + GET_SIZE(next_bp);
+    // Neither shrinking nor growing into the next block worked; move it
+    // within the same heap so it keeps its lifetime
+    byte_t* new_ptr = alloc_block(heap, size);
+
+    if (new_ptr == NULL) {
+        DEBUG("Failed to make new pointer");
+        return NULL;
+    }
+
+    // Copy old data over
+    memcpy(new_ptr, ptr, GET_SIZE(ptr));
+
+    free_block(heap, ptr);
+    DEBUG("Made new pointer entirely");
+    return new_ptr;
+}
+
+static int resize_block(heap_t* heap, byte_t* ptr, size_t size)
+{
+    size = ALIGN_BYTES(size);
+    size = MAX(size, MIN_DATA_SIZE);
+    word_t current_size = GET_SIZE(ptr);
+
+    if (size == current_size) {
+        DEBUG("No change needed");
+        return 0;
+    }
+
+    if (size < current_size) {
+        size_t leftover = current_size - size;
+
+        if (leftover < options.split_threshold) {
+            // Not enough leftovers to make a new free block
+            DEBUG("Too few leftovers, no change needed");
+            return 0;
+        }
+
+        // Create new free block from leftovers
+        REDO_HEADERS(ptr, size, ALLOCATED);
+        byte_t* new_fp = GET_NEXT_BLOCK(ptr);
+        REDO_HEADERS(new_fp, leftover - HEADER_SIZE - BOUNDARY_SIZE, FREE);
+        TRACE(split, ptr, new_fp, leftover);
+        free_block(heap, new_fp);
+
+        DEBUG("Shrunk and created new free block");
+        return 0;
+    }
+
+    size_t needed = size - current_size;
+    byte_t* next_bp = GET_NEXT_BLOCK(ptr);
+    size_t gained_in_merge = BOUNDARY_SIZE + HEADER_SIZE + GET_SIZE(next_bp);
+
+    if (GET_ALLOC(next_bp) == ALLOCATED || gained_in_merge < needed
+        || remove_free_block(heap, next_bp) == -1) {
+        // Next block is not free or next block is not large enough
+        DEBUG("Can't grow in place");
+        return -1;
+    }
+
+    // Next block can be merged into
+    size_t leftover = gained_in_merge - needed;
+
+    if (leftover == 0) {
+        // Next block was exactly large enough
+        REDO_HEADERS(ptr, size, ALLOCATED);
+        DEBUG("Absorb next block");
+        return 0;
+    }
+
+    if (leftover < options.split_threshold) {
+        // Not enough leftovers to create a new free block; absorb it entirely
+        size = current_size + gained_in_merge;
+        REDO_HEADERS(ptr, size, ALLOCATED);
+        DEBUG("Expand and absorb next block");
+        return 0;
+    }
+
+    // Create new free block from leftovers
+    REDO_HEADERS(ptr, size, ALLOCATED);
+    byte_t* new_fp = GET_NEXT_BLOCK(ptr);
+    REDO_HEADERS(new_fp, leftover - HEADER_SIZE - BOUNDARY_SIZE, FREE);
+    TRACE(split, ptr, new_fp, leftover);
+    free_block(heap, new_fp);
+
+    DEBUG("Absorbed part of next block and created new free block");
+    return 0;
+}
+
+mlock_pool_t* mlock_pool_create(size_t object_size, size_t alignment)
+{
+    return mlock_cache_create(object_size, alignment, NULL, NULL, NULL);
+}
+
+mlock_pool_t* mlock_cache_create(size_t object_size, size_t alignment,
+    mlock_ctor_fn ctor, mlock_dtor_fn dtor, void* arg)
+{
+    alignment = alignment ? alignment : 8;
+
+    if (object_size == 0 || (alignment & (alignment - 1))
+        || alignment > PAGE_SIZE) {
+        DEBUG("Can't make a pool of size %ld aligned to %ld", object_size,
+            alignment);
+        return NULL;
+    }
+
+    // Free objects hold a pointer to the next one, after any constructed
+    // state
+    size_t link_offset = ctor || dtor ? ALIGN_BYTES(object_size) : 0;
+    size_t stride = MAX(object_size, link_offset + sizeof(byte_t*));
+    stride = (stride + alignment - 1) & ~(alignment - 1);
+
+    lock_meta();
+    mlock_pool_t* pool = free_pools;
+
+    if (pool != NULL) {
+        free_pools = pool->next;
+    } else if ((pool = meta_alloc(sizeof(mlock_pool_t))) != NULL) {
+        pthread_mutex_init(&pool->lock, NULL);
+    }
+
+    if (pool != NULL) {
+        pool->object_size = stride;
+        pool->link_offset = link_offset;
+        pool->slab_size = MAX(SLAB_SIZE, ALIGN_PAGES(stride * SLAB_OBJECTS));
+        pool->free = pool->raw = pool->bump = pool->bump_end = NULL;
+        pool->slabs = NULL;
+        pool->ctor = ctor;
+        pool->dtor = dtor;
+        pool->arg = arg;
+        pool->next = live_pools;
+        live_pools = pool;
+        __atomic_store_n(&pool->id, ++last_pool_id, __ATOMIC_RELEASE);
+    }
+
+    unlock_meta();
+    DEBUG("Created pool %p of %ld-byte objects", pool, stride);
+    return pool;
+}
+
+void* mlock_pool_alloc(mlock_pool_t* pool)
+{
+    pool_cache_t* cache = pool_cache(pool);
+
+    if (cache->head == NULL && pool_refill(pool, cache) == -1) {
+        DEBUG("Pool %p is out of memory", pool);
+        return NULL;
+    }
+
+    byte_t* obj = cache->head;
+    cache->head = GET_POOL_NEXT(pool, obj);
+    cache->count--;
+    return obj;
+}
+
+void mlock_pool_free(mlock_pool_t* pool, void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    pool_cache_t* cache = pool_cache(pool);
+    PUT_POOL_NEXT(pool, ptr, cache->head);
+    cache->head = ptr;
+
+    if (++cache->count > POOL_CACHE_MAX) {
+        pool_flush(cache, POOL_BATCH);
+    }
+}
+
+size_t mlock_pool_reap(mlock_pool_t* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    // Detach the slabs none of whose objects are handed out
+    slab_t* empty = NULL;
+    slab_t** link = &pool->slabs;
+
+    while (*link != NULL) {
+        slab_t* slab = *link;
+
+        if (slab->live != 0) {
+            link = &slab->next;
+            continue;
+        }
+
+        if (pool->bump >= slab->span.start
+            && pool->bump < slab->span.start + slab->span.size) {
+            pool->bump = pool->bump_end = NULL;
+        }
+
+        *link = slab->next;
+        slab->next = empty;
+        empty = slab;
+    }
+
+    // Pull their free objects out of the lists, keeping the constructed ones
+    // to destroy
+    byte_t* doomed = NULL;
+    byte_t** lists[] = { &pool->free, &pool->raw };
+
+    for (int i = 0; i < 2; i++) {
+        byte_t** obj = lists[i];
+
+        while (*obj != NULL) {
+            byte_t* next = GET_POOL_NEXT(pool, *obj);
+
+            if (GET_SLAB(*obj)->live != 0) {
+                obj = (byte_t**)(*obj + pool->link_offset);
+            } else if (i == 0) {
+                PUT_POOL_NEXT(pool, *obj, doomed);
+                doomed = *obj;
+                *obj = next;
+            } else {
+                *obj = next;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    destroy_objects(pool, doomed);
+    size_t released = release_slabs(empty);
+    DEBUG("Reaped %ld bytes of slabs from pool %p", released, pool);
+    return released;
+}
+
+void mlock_pool_destroy(mlock_pool_t* pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    DEBUG("Destroying pool %p", pool);
+
+    // Give back this thread's cached objects so they're destructed too
+    pool_cache_t* cache = pool_cache(pool);
+    pool_flush(cache, cache->count);
+
+    // Other threads' caches see the id change and drop their objects
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->id, 0, __ATOMIC_RELEASE);
+    byte_t* obj = pool->free;
+    slab_t* slabs = pool->slabs;
+    pool->slabs = NULL;
+    pool->free = pool->raw = pool->bump = pool->bump_end = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    destroy_objects(pool, obj);
+    release_slabs(slabs);
+    lock_meta();
+
+    mlock_pool_t** link = &live_pools;
+    while (*link != pool) {
+        link = &(*link)->next;
+    }
+
+    *link = pool->next;
+    pool->next = free_pools;
+    free_pools = pool;
+    unlock_meta();
+}
+
+static pool_cache_t* pool_cache(mlock_pool_t* pool)
+{
+    word_t id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    pool_cache_t* cache = &pool_caches[id % POOL_CACHES];
+
+    if (cache->pool != pool || cache->id != id) {
+        // Another pool had the slot; give its objects back
+        pool_flush(cache, cache->count);
+        register_thread();
+        cache->pool = pool;
+        cache->id = id;
+    }
+
+    return cache;
+}
+
+static int pool_refill(mlock_pool_t* pool, pool_cache_t* cache)
+{
+    byte_t* raw = NULL;
+    unsigned moved = 0;
+    unsigned raw_count = 0;
+    pthread_mutex_lock(&pool->lock);
+
+    while (moved + raw_count < POOL_BATCH) {
+        byte_t* obj;
+
+        if (pool->free != NULL) {
+            // Reuse freed objects before never-used ones
+            obj = pool->free;
+            pool->free = GET_POOL_NEXT(pool, obj);
+            GET_SLAB(obj)->live++;
+            PUT_POOL_NEXT(pool, obj, cache->head);
+            cache->head = obj;
+            moved++;
+            continue;
+        }
+
+        if (pool->raw != NULL) {
+            obj = pool->raw;
+            pool->raw = GET_POOL_NEXT(pool, obj);
+        } else if (pool->bump != pool->bump_end) {
+            obj = pool->bump;
+            pool->bump += pool->object_size;
+        } else if (moved + raw_count > 0) {
+            break;
+        } else {
+            pthread_mutex_unlock(&pool->lock);
+            slab_t* slab = grab_slab(pool);
+            pthread_mutex_lock(&pool->lock);
+
+            if (slab == NULL) {
+                break;
+            }
+
+            // Another thread may have added a slab meanwhile; keep what's
+            // left of it
+            for (; pool->bump != pool->bump_end;
+                 pool->bump += pool->object_size) {
+                PUT_POOL_NEXT(pool, pool->bump, pool->raw);
+                pool->raw = pool->bump;
+            }
+
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            pool->bump = slab->span.start;
+            pool->bump_end = pool->bump
+                + pool->slab_size / pool->object_size * pool->object_size;
+            continue;
+        }
+
+        GET_SLAB(obj)->live++;
+        PUT_POOL_NEXT(pool, obj, raw);
+        raw = obj;
+        raw_count++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    // Constructors may allocate and free, so they run outside the pool lock
+    while (raw != NULL) {
+        byte_t* obj = raw;
+        byte_t* next = GET_POOL_NEXT(pool, obj);
+
+        if (pool->ctor != NULL && pool->ctor(obj, pool->arg) != 0) {
+            DEBUG("Failed to construct an object of pool %p", pool);
+            break;
+        }
+
+        PUT_POOL_NEXT(pool, obj, cache->head);
+        cache->head = obj;
+        moved++;
+        raw = next;
+    }
+
+    if (raw != NULL) {
+        // Give the objects that weren't constructed back as they are
+        pthread_mutex_lock(&pool->lock);
+
+        while (raw != NULL) {
+            byte_t* next = GET_POOL_NEXT(pool, raw);
+            GET_SLAB(raw)->live--;
+            PUT_POOL_NEXT(pool, raw, pool->raw);
+            pool->raw = raw;
+            raw = next;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    cache->count += moved;
+    return moved > 0 ? 0 : -1;
+}
+
+static void pool_flush(pool_cache_t* cache, unsigned count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    mlock_pool_t* pool = cache->pool;
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->id != cache->id) {
+        // The pool was destroyed along with the objects' memory
+        pthread_mutex_unlock(&pool->lock);
+        cache->head = NULL;
+        cache->count = 0;
+        return;
+    }
+
+    byte_t* first = cache->head;
+    byte_t* last = first;
+    GET_SLAB(last)->live--;
+
+    for (unsigned i = 1; i < count; i++) {
+        last = GET_POOL_NEXT(pool, last);
+        GET_SLAB(last)->live--;
+    }
+
+    cache->head = GET_POOL_NEXT(pool, last);
+    cache->count -= count;
+    PUT_POOL_NEXT(pool, last, pool->free);
+    pool->free = first;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void destroy_objects(mlock_pool_t* pool, byte_t* obj)
+{
+    if (pool->dtor == NULL) {
+        return;
+    }
+
+    // Destructors may allocate and free, so they run outside the pool lock
+    while (obj != NULL) {
+        byte_t* next = GET_POOL_NEXT(pool, obj);
+        pool->dtor(obj, pool->arg);
+        obj = next;
+    }
+}
+
+static size_t release_slabs(slab_t* slab)
+{
+    size_t released = 0;
+
+    // Blocks are freed without the global lock, which an arena's lock must
+    // not be waited on under
+    for (slab_t* s = slab; s != NULL; s = s->next) {
+        lock_meta();
+        pagemap_set(s->span.start, s->span.size, s->block_span);
+        unlock_meta();
+        free_to_arena(s->block_span->owner, s->block);
+        released += s->span.size;
+    }
+
+    lock_meta();
+
+    while (slab != NULL) {
+        slab_t* next = slab->next;
+        slab->next = free_slabs;
+        free_slabs = slab;
+        slab = next;
+    }
+
+    unlock_meta();
+    return released;
+}
+
+static slab_t* grab_slab(mlock_pool_t* pool)
+{
+    arena_t* arena = pick_arena();
+
+    if (arena == NULL) {
+        DEBUG("Failed to initialize memory on first use");
+        return NULL;
+    }
+
+    // Over-allocate by a page so the slab can start on a page boundary, and
+    // its pages belong to nothing else
+    heap_t* heap = &arena->heaps[MLOCK_HINT_LONG];
+    lock_arena(arena);
+    byte_t* bp = alloc_block(heap, pool->slab_size + PAGE_SIZE);
+    slab_t* slab = NULL;
+    lock_meta();
+
+    if (bp != NULL) {
+        slab = free_slabs;
+
+        if (slab != NULL) {
+            free_slabs = slab->next;
+        } else {
+            slab = meta_alloc(sizeof(slab_t));
+        }
+    }
+
+    if (slab == NULL) {
+        DEBUG("Failed to grab a slab for pool %p", pool);
+        if (bp != NULL) {
+            free_block(heap, bp);
+        }
+        unlock_meta();
+        unlock_arena(arena);
+        return NULL;
+    }
+
+    slab->span.kind = SPAN_SLAB;
+    slab->span.start = (byte_t*)ALIGN_PAGES((word_t)bp);
+    slab->span.size = pool->slab_size;
+    slab->span.owner = pool;
+    slab->block = bp;
+    slab->block_span = pagemap_get(bp);
+    slab->next = NULL;
+
+    if (pagemap_set(slab->span.start, slab->span.size, &slab->span) == -1) {
+        DEBUG("Failed to map slab %p", slab->span.start);
+        pagemap_set(slab->span.start, slab->span.size, slab->block_span);
+        free_block(heap, bp);
+        slab->next = free_slabs;
+        free_slabs = slab;
+        slab = NULL;
+    }
+
+    unlock_meta();
+    unlock_arena(arena);
+    return slab;
+}
+
+mlock_iobufs_t* mlock_iobufs_create(size_t buffer_size, size_t count)
+{
+    buffer_size = ALIGN_PAGES(buffer_size);
+
+    if (buffer_size == 0 || count == 0 || count > INT32_MAX
+        || count > SIZE_MAX / buffer_size) {
+        DEBUG("Can't make %ld I/O buffers of %ld bytes", count, buffer_size);
+        return NULL;
+    }
+
+    size_t bytes = buffer_size * count;
+    size_t iovec_bytes = ALIGN_PAGES(count * sizeof(struct iovec));
+    byte_t* start = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec* iovecs = mmap(NULL, iovec_bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    // Pinned once here, so I/O on the buffers never has to
+    if (start == MAP_FAILED || iovecs == MAP_FAILED
+        || pin_pages(start, bytes) == -1) {
+        DEBUG("Failed to map and lock %ld bytes of I/O buffers", bytes);
+        if (start != MAP_FAILED) {
+            munmap(start, bytes);
+        }
+        if (iovecs != MAP_FAILED) {
+            munmap(iovecs, iovec_bytes);
+        }
+        return NULL;
+    }
+
+    lock_meta();
+    mlock_iobufs_t* bufs = free_iobufs;
+
+    if (bufs != NULL) {
+        free_iobufs = bufs->next;
+    } else {
+        bufs = meta_alloc(sizeof(mlock_iobufs_t));
+    }
+
+    if (bufs != NULL) {
+        bufs->span.kind = SPAN_IOBUF;
+        bufs->span.start = start;
+        bufs->span.size = bytes;
+        bufs->span.owner = bufs;
+        bufs->buffer_size = buffer_size;
+        bufs->count = count;
+        bufs->iovecs = iovecs;
+        bufs->next = NULL;
+
+        if (pagemap_set(start, bytes, &bufs->span) == -1) {
+            pagemap_set(start, bytes, NULL);
+            bufs->next = free_iobufs;
+            free_iobufs = bufs;
+            bufs = NULL;
+        }
+    }
+
+    unlock_meta();
+
+    if (bufs == NULL) {
+        DEBUG("Failed to make a pool of the I/O buffers at %p", start);
+        munmap(start, bytes);
+        munmap(iovecs, iovec_bytes);
+        return NULL;
+    }
+
+    // Link the buffers so the lowest is handed out first
+    byte_t* next = NULL;
+
+    for (size_t i = count; i-- > 0;) {
+        byte_t* buf = start + i * buffer_size;
+        iovecs[i].iov_base = buf;
+        iovecs[i].iov_len = buffer_size;
+        PUT_WORD(buf, (word_t)next);
+        next = buf;
+    }
+
+    __atomic_store_n(&bufs->top, PACK_STACK(start, 0), __ATOMIC_RELEASE);
+    DEBUG("Created %ld pinned I/O buffers of %ld bytes at %p", count,
+        buffer_size, start);
+    return bufs;
+}
+
+void* mlock_iobuf_alloc(mlock_iobufs_t* bufs)
+{
+    uint64_t top = __atomic_load_n(&bufs->top, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    byte_t* buf;
+
+    do {
+        buf = STACK_TOP(top);
+
+        if (buf == NULL) {
+            DEBUG("I/O buffer pool %p has no free buffers", bufs);
+            return NULL;
+        }
+
+        // The buffer may already be popped and in use; it stays mapped, so
+        // the read is harmless, and the version has moved on, so the swap
+        // fails
+        next = PACK_STACK(GET_WORD(buf), STACK_VERSION(top) + 1);
+    } while (!__atomic_compare_exchange_n(&bufs->top, &top, next, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return buf;
+}
+
+void mlock_iobuf_free(mlock_iobufs_t* bufs, void* buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+
+    if (mlock_iobuf_index(bufs, buf) == -1
+        || ((byte_t*)buf - bufs->span.start) % bufs->buffer_size != 0) {
+        DEBUG("Pointer %p isn't a buffer of I/O buffer pool %p", buf, bufs);
+        return;
+    }
+
+    uint64_t top = __atomic_load_n(&bufs->top, __ATOMIC_RELAXED);
+
+    do {
+        PUT_WORD(buf, (word_t)STACK_TOP(top));
+    } while (!__atomic_compare_exchange_n(&bufs->top, &top,
+        PACK_STACK(buf, STACK_VERSION(top) + 1), 0, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED));
+}
+
+const struct iovec* mlock_iobufs_iovecs(const mlock_iobufs_t* bufs,
+    unsigned* count)
+{
+    *count = bufs->count;
+    return bufs->iovecs;
+}
+
+int mlock_iobuf_index(const mlock_iobufs_t* bufs, const void* buf)
+{
+    if (buf == NULL || (byte_t*)buf < bufs->span.start
+        || (byte_t*)buf >= bufs->span.start + bufs->span.size) {
+        return -1;
+    }
+
+    return ((byte_t*)buf - bufs->span.start) / bufs->buffer_size;
+}
+
+void mlock_iobufs_destroy(mlock_iobufs_t* bufs)
+{
+    if (bufs == NULL) {
+        return;
+    }
+
+    DEBUG("Destroying I/O buffer pool %p", bufs);
+
+    // Unmapping unlocks the pages too
+    lock_meta();
+    pagemap_set(bufs->span.start, bufs->span.size, NULL);
+    munmap(bufs->span.start, bufs->span.size);
+    munmap(bufs->iovecs, ALIGN_PAGES(bufs->count * sizeof(struct iovec)));
+    bufs->next = free_iobufs;
+    free_iobufs = bufs;
+    unlock_meta();
+}
+
+static int pin_pages(byte_t* start, size_t size)
+{
+#ifdef __linux__
+    // The libc wrapper is named mlock too, so it is renamed away above
+    return syscall(SYS_mlock, start, size) == 0 ? 0 : -1;
+#else
+    (void)start;
+    (void)size;
+    return -1;
+#endif
+}
+
+void* mlock_ring(size_t size)
+{
+    size = ALIGN_PAGES(size);
+
+    if (size == 0 || size > SIZE_MAX / 2) {
+        DEBUG("Can't make a ring of %ld bytes", size);
+        return NULL;
+    }
+
+    // Reserve both halves at once, so nothing else lands in between
+    byte_t* start = mmap(NULL, size * 2, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-    if (GET_ALLOC(next_bp) == ALLOCATED || gained_in_merge < needed) {
-        // Next block is not free or next block is not large enough
-        byte_t* new_ptr = mlock(size);
+    if (start == MAP_FAILED) {
+        DEBUG("Failed to reserve %ld bytes for a ring", size * 2);
+        return NULL;
+    }
+
+    if (map_ring(start, size) == -1) {
+        DEBUG("Failed to map a ring of %ld bytes twice", size);
+        munmap(start, size * 2);
+        return NULL;
+    }
 
-        // Copy old data over
-        memcpy(new_ptr, ptr, current_size);
+    lock_meta();
+    span_t* span = free_spans;
 
-        unlock(ptr);
-        DEBUG("Made new pointer entirely");
-        return new_ptr;
+    if (span != NULL) {
+        free_spans = span->owner;
+    } else {
+        span = meta_alloc(sizeof(span_t));
     }
 
-    // Next block can be merged into
-    remove_free_block(next_bp);
-    size_t leftover = gained_in_merge - needed;
+    if (span != NULL) {
+        span->kind = SPAN_RING;
+        span->start = start;
+        span->size = size * 2;
+        span->owner = NULL;
 
-    if (leftover == 0) {
-        // Next block was exactly large enough
-        REDO_HEADERS(ptr, size, ALLOCATED);
-        DEBUG("Absorb next block");
-        return ptr;
+        if (pagemap_set(start, size * 2, span) == -1) {
+            pagemap_set(start, size * 2, NULL);
+            span->owner = free_spans;
+            free_spans = span;
+            span = NULL;
+        }
     }
 
-    if (leftover < MIN_BLOCK_SIZE) {
-        // Not enough leftovers to create a new free block; absorb it entirely
-        size = current_size + gained_in_merge;
-        REDO_HEADERS(ptr, size, ALLOCATED);
-        DEBUG("Expand and absorb next block");
-        return ptr;
+    unlock_meta();
+
+    if (span == NULL) {
+        DEBUG("Failed to map the ring's pages");
+        munmap(start, size * 2);
+        return NULL;
     }
 
-    // Create new free block from leftovers
-    REDO_HEADERS(ptr, size, ALLOCATED);
-    byte_t* new_fp = GET_NEXT_BLOCK(ptr);
-    REDO_HEADERS(new_fp, leftover - HEADER_SIZE - BOUNDARY_SIZE, FREE);
-    unlock(new_fp);
+    DEBUG("Mapped a ring of %ld bytes at %p", size, start);
+    return start;
+}
 
-    DEBUG("Absorbed part of next block and created new free block");
-    return ptr;
+void unlock_ring(void* ring)
+{
+    span_t* span = pagemap_get(ring);
+
+    if (span == NULL || span->kind != SPAN_RING || span->start != ring) {
+        DEBUG("Pointer %p isn't a ring", ring);
+        return;
+    }
+
+    DEBUG("Unmapping ring %p", ring);
+    lock_meta();
+    pagemap_set(span->start, span->size, NULL);
+    munmap(span->start, span->size);
+    span->owner = free_spans;
+    free_spans = span;
+    unlock_meta();
+}
+
+static int map_ring(byte_t* start, size_t size)
+{
+#ifdef __linux__
+    int fd = syscall(SYS_memfd_create, "mlock_ring", MFD_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    int result = ftruncate(fd, size);
+
+    for (int half = 0; half < 2 && result == 0; half++) {
+        if (mmap(start + size * half, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0)
+            == MAP_FAILED) {
+            result = -1;
+        }
+    }
+
+    // The mappings keep the file's pages alive once it's closed
+    close(fd);
+    return result == 0 ? 0 : -1;
+#else
+    (void)start;
+    (void)size;
+    return -1;
+#endif
+}
+
+static int remove_free_block(heap_t* heap, byte_t* fp)
+{
+    int bin = SIZE_BIN(GET_SIZE(fp));
+    heap_lock(&heap->bin_locks[bin]);
+
+    if (GET_ALLOC(fp) == ALLOCATED) {
+        DEBUG("Free block %p was taken meanwhile", fp);
+        heap_unlock(&heap->bin_locks[bin]);
+        return -1;
+    }
+
+    unlink_free_block(heap, fp);
+    heap_unlock(&heap->bin_locks[bin]);
+    return 0;
 }
 
-static void remove_free_block(byte_t* fp)
+static void unlink_free_block(heap_t* heap, byte_t* fp)
 {
     DEBUG("Removing free block %p", fp);
     byte_t* next = GET_NEXT_FREE(fp);
     byte_t* prev = GET_PREV_FREE(fp);
 
-    if (fp == free_list) {
-        free_list = next;
+    if (prev == NULL) {
+        int bin = SIZE_BIN(GET_SIZE(fp));
+        heap->free_lists[bin] = next;
+
+        if (next == NULL) {
+            __atomic_and_fetch(
+                &heap->bins_used, ~(1ULL << bin), __ATOMIC_RELEASE);
+        }
     }
 
     LINK_FREE(prev, next);
+
+#ifdef MLOCK_ENABLE_FREE_INDEX
+    index_remove(heap, fp);
+#endif
     DEBUG("Removed free block %p", fp);
 }
 
-static int extend_heap(size_t size)
+static void insert_free_block(heap_t* heap, byte_t* fp)
+{
+    int bin = SIZE_BIN(GET_SIZE(fp));
+    heap_lock(&heap->bin_locks[bin]);
+    byte_t* prev = NULL;
+    byte_t* next = heap->free_lists[bin];
+
+    if (options.order_policy == MLOCK_ORDER_ADDRESS) {
+        // Keep the bin sorted so its lowest blocks are found first
+        while (next != NULL && next < fp) {
+            prev = next;
+            next = GET_NEXT_FREE(next);
+        }
+    }
+
+    PUT_PREV_FREE(fp, prev);
+    PUT_NEXT_FREE(fp, next);
+
+    if (next != NULL) {
+        PUT_PREV_FREE(next, fp);
+    }
+
+    if (prev != NULL) {
+        PUT_NEXT_FREE(prev, fp);
+    } else {
+        heap->free_lists[bin] = fp;
+        __atomic_or_fetch(&heap->bins_used, 1ULL << bin, __ATOMIC_RELEASE);
+    }
+
+#ifdef MLOCK_ENABLE_FREE_INDEX
+    index_insert(heap, fp);
+#endif
+    heap_unlock(&heap->bin_locks[bin]);
+}
+
+static int extend_heap(heap_t* heap, size_t size)
 {
     DEBUG("Extending heap with %ld bytes", size);
 
     size = ALIGN_BYTES(size);
-    byte_t* fp = sbrk(size + BOUNDARY_SIZE + HEADER_SIZE);
+    span_t* top = heap->top;
+    size_t bytes = size + BOUNDARY_SIZE + HEADER_SIZE;
+
+    if (top == NULL) {
+        return map_segment(heap, size);
+    }
+
+    if (hard_limit && heap_bytes() + bytes > hard_limit) {
+        DEBUG("Extending heap would pass its hard limit");
+        return -1;
+    }
+
+    byte_t* fp = sbrk(bytes);
 
     if (fp == (void*)-1) {
-        DEBUG("sbrk failed to extend heap");
+        DEBUG("sbrk failed to extend heap; mapping a segment instead");
+        return map_segment(heap, size);
+    }
+
+    if (fp != top->start + top->size) {
+        // Something else moved the break, so the new memory doesn't follow
+        // the epilogue; give it back and grow with segments from now on
+        DEBUG("Heap isn't contiguous at %p; mapping a segment instead", fp);
+        sbrk(-(intptr_t)bytes);
+        heap->top = NULL;
+        return map_segment(heap, size);
+    }
+
+    lock_meta();
+    int mapped = pagemap_set(fp, bytes, top);
+    unlock_meta();
+
+    if (mapped == -1) {
+        DEBUG("Failed to map the extended heap");
+        sbrk(-(intptr_t)bytes);
         return -1;
     }
 
+    __atomic_store_n(&top->size, top->size + bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&heap->size, bytes, __ATOMIC_RELAXED);
+    TRACE(extend_heap, fp, size);
+
+    const mlock_hooks_t* active = __atomic_load_n(&hooks, __ATOMIC_ACQUIRE);
+
+    if (active != NULL && active->on_grow != NULL && !in_hook) {
+        in_hook = 1;
+        active->on_grow(fp, bytes, active->arg);
+        in_hook = 0;
+    }
+
     REDO_HEADERS(fp, size, FREE);  // Override old epilogue with new header
     PUT_WORD(GET_NEXT_HEADER(fp), PACK_HEADER(0, ALLOCATED));  // New epilogue
 
-    // Inserts fp into free_list
-    unlock(fp);
-    DEBUG("Extended heap to make new block and inserted into free_list");
+    // Inserts fp into the free lists
+    free_block(heap, fp);
+    DEBUG("Extended heap to make new block and inserted into free lists");
+    return 0;
+}
+
+static int map_segment(heap_t* heap, size_t size)
+{
+    // Padding, prologue header and boundary tag, the block's header and
+    // boundary tag, and the epilogue header
+    size_t overhead = WORD_SIZE * 6;
+    size_t bytes = ALIGN_PAGES(MAX(size, SEGMENT_SIZE) + overhead);
+
+    if (hard_limit && heap_bytes() + bytes > hard_limit) {
+        bytes = ALIGN_PAGES(size + overhead);
+    }
+
+    if (hard_limit && heap_bytes() + bytes > hard_limit) {
+        DEBUG("Mapping a segment would pass the hard limit");
+        return -1;
+    }
+
+    byte_t* start = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (start == MAP_FAILED) {
+        DEBUG("Failed to map a segment of %ld bytes", bytes);
+        return -1;
+    }
+
+    lock_meta();
+    span_t* span = free_spans;
+
+    if (span != NULL) {
+        free_spans = span->owner;
+    } else {
+        span = meta_alloc(sizeof(span_t));
+    }
+
+    if (span == NULL) {
+        DEBUG("Failed to allocate a segment span");
+        unlock_meta();
+        munmap(start, bytes);
+        return -1;
+    }
+
+    span->kind = SPAN_HEAP;
+    span->start = start;
+    span->size = bytes;
+    span->owner = heap;
+
+    if (pagemap_set(start, bytes, span) == -1) {
+        DEBUG("Failed to map the segment's pages");
+        pagemap_set(start, bytes, NULL);
+        span->owner = free_spans;
+        free_spans = span;
+        unlock_meta();
+        munmap(start, bytes);
+        return -1;
+    }
+
+    unlock_meta();
+    __atomic_add_fetch(&heap->size, bytes, __ATOMIC_RELAXED);
+
+    PUT_WORD(start, 0x00DECADE);
+    PUT_WORD(start + WORD_SIZE, PACK_HEADER(0, ALLOCATED));  // Prologue header
+    PUT_WORD(start + WORD_SIZE * 2, PACK_HEADER(0, ALLOCATED));  // Boundary
+
+    byte_t* fp = start + WORD_SIZE * 4;
+    REDO_HEADERS(fp, bytes - overhead, FREE);
+    PUT_WORD(GET_NEXT_HEADER(fp), PACK_HEADER(0, ALLOCATED));  // Epilogue
+    TRACE(extend_heap, fp, bytes - overhead);
+
+    const mlock_hooks_t* active = __atomic_load_n(&hooks, __ATOMIC_ACQUIRE);
+
+    if (active != NULL && active->on_grow != NULL && !in_hook) {
+        in_hook = 1;
+        active->on_grow(start, bytes, active->arg);
+        in_hook = 0;
+    }
+
+    // Fresh pages read as zero, so the block counts as already purged
+    insert_free_block(heap, fp);
+    DEBUG("Mapped segment %p for heap %p", start, heap);
     return 0;
 }
 
-static void place(byte_t* fp, word_t size)
+static void release_segment(heap_t* heap, byte_t* fp)
+{
+    span_t* span = pagemap_get(fp);
+    DEBUG("Releasing drained segment %p", span->start);
+
+    byte_t* start = span->start;
+    size_t size = span->size;
+    __atomic_sub_fetch(&heap->size, size, __ATOMIC_RELAXED);
+
+    lock_meta();
+    pagemap_set(start, size, NULL);
+    span->owner = free_spans;
+    free_spans = span;
+    unlock_meta();
+    munmap(start, size);
+}
+
+static byte_t* place(heap_t* heap, byte_t* fp, word_t size, word_t pad)
 {
     DEBUG("Placing a block of size %ld at pointer %p", size, fp);
 
-    remove_free_block(fp);
     size = ALIGN_BYTES(size);
 
+    if (pad != 0) {
+        // Split the padding off the front as its own free block
+        byte_t* pad_fp = fp;
+        word_t rest = GET_SIZE(fp) - pad;
+        REDO_HEADERS(pad_fp, pad - HEADER_SIZE - BOUNDARY_SIZE, FREE);
+        fp = GET_NEXT_BLOCK(pad_fp);
+        REDO_HEADERS(fp, rest, ALLOCATED);
+        TRACE(split, pad_fp, fp, pad);
+        free_block(heap, pad_fp);
+    }
+
     word_t available_size = GET_SIZE(fp);
     word_t difference = available_size - size;
 
@@ -491,47 +4908,369 @@ static void place(byte_t* fp, word_t size)
         // No adjustment needed
         REDO_HEADERS(fp, size, ALLOCATED);
         DEBUG("Placed block");
-        return;
+        return fp;
     }
 
-    if (difference < MIN_BLOCK_SIZE) {
+    if (difference < options.split_threshold) {
         // Not enough space to make a new block; grow to absorb leftovers
         size = available_size;
         REDO_HEADERS(fp, size, ALLOCATED);
         DEBUG("Expanded and placed block");
-        return;
+        return fp;
     }
 
     // Create new free block
     REDO_HEADERS(fp, size, ALLOCATED);
     byte_t* new_fp = GET_NEXT_BLOCK(fp);
     REDO_HEADERS(new_fp, difference - HEADER_SIZE - BOUNDARY_SIZE, FREE);
-    unlock(new_fp);
+    TRACE(split, fp, new_fp, difference);
+    free_block(heap, new_fp);
     DEBUG("Placed block and made new free block from leftovers");
+    return fp;
+}
+
+static word_t color_pad(byte_t* fp, word_t size)
+{
+    if (options.color_threshold == 0 || size < options.color_threshold) {
+        return 0;
+    }
+
+    unsigned color = __atomic_load_n(&next_color, __ATOMIC_RELAXED);
+    word_t pad = (color % options.color_count) * COLOR_STEP;
+
+    if (GET_SIZE(fp) - size < pad) {
+        DEBUG("No room to color block at %p", fp);
+        return 0;
+    }
+
+    __atomic_add_fetch(&next_color, 1, __ATOMIC_RELAXED);
+    return pad;
 }
 
-static byte_t* find_fit(word_t size)
+static byte_t* find_fit(heap_t* heap, word_t size)
 {
     DEBUG("Searching for free block of size %ld", size);
 
-    if (free_list == NULL) {
-        DEBUG("Free list is empty");
+    if (__atomic_load_n(&heap->bins_used, __ATOMIC_ACQUIRE) == 0) {
+        DEBUG("Free lists are empty");
         return NULL;
     }
 
     size = ALIGN_BYTES(size);
 
-    byte_t* fp = free_list;
+#ifdef MLOCK_ENABLE_FREE_INDEX
+    // Nothing takes blocks without the arena lock in this build
+    byte_t* best = index_find(heap, size);
+
+    if (best != NULL) {
+        remove_free_block(heap, best);
+    }
+
+    return best;
+#else
+    // Blocks in the size's own bin may be too small
+    int bin = SIZE_BIN(size);
+    byte_t* best = NULL;
+    heap_lock(&heap->bin_locks[bin]);
+    byte_t* fp = heap->free_lists[bin];
     for (; fp != NULL; fp = GET_NEXT_FREE(fp)) {
-        if (GET_SIZE(fp) >= size) {
-            DEBUG("Found pointer %p", fp);
-            return fp;
+        word_t fp_size = GET_SIZE(fp);
+
+        if (fp_size < size || (best != NULL && fp_size >= GET_SIZE(best))) {
+            continue;
+        }
+
+        best = fp;
+
+        if (options.fit_policy == MLOCK_FIT_FIRST || fp_size == size) {
+            break;
+        }
+    }
+
+    if (best != NULL) {
+        unlink_free_block(heap, best);
+    }
+
+    heap_unlock(&heap->bin_locks[bin]);
+    unsigned long long larger = LARGER_BINS(
+        __atomic_load_n(&heap->bins_used, __ATOMIC_ACQUIRE), bin);
+
+    // A bin may have emptied before its lock was taken; try the next one
+    for (; best == NULL && larger; larger &= larger - 1) {
+        // Every block in a larger bin fits, and with address ordering the
+        // head is the lowest
+        int larger_bin = __builtin_ctzll(larger);
+        heap_lock(&heap->bin_locks[larger_bin]);
+        best = heap->free_lists[larger_bin];
+
+        for (fp = best ? GET_NEXT_FREE(best) : NULL;
+             fp != NULL && options.fit_policy == MLOCK_FIT_BEST;
+             fp = GET_NEXT_FREE(fp)) {
+            if (GET_SIZE(fp) < GET_SIZE(best)) {
+                best = fp;
+            }
+        }
+
+        if (best != NULL) {
+            unlink_free_block(heap, best);
+        }
+
+        heap_unlock(&heap->bin_locks[larger_bin]);
+    }
+
+    if (best == NULL) {
+        DEBUG("Found no block large enough");
+    } else {
+        DEBUG("Found pointer %p", best);
+    }
+
+    return best;
+#endif
+}
+
+static void* meta_alloc(size_t size)
+{
+    size = ALIGN_BYTES(size);
+
+    if (meta_next == NULL || (size_t)(meta_end - meta_next) < size) {
+        size_t chunk = MAX(ALIGN_PAGES(size), META_CHUNK);
+        byte_t* mem = mmap(NULL, chunk, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mem == MAP_FAILED) {
+            DEBUG("Failed to map %ld bytes of metadata", chunk);
+            return NULL;
+        }
+
+        meta_next = mem;
+        meta_end = mem + chunk;
+    }
+
+    void* ptr = meta_next;
+    meta_next += size;
+    return ptr;
+}
+
+static int pagemap_set(byte_t* start, size_t size, span_t* span)
+{
+    DEBUG("Mapping %ld bytes at %p to span %p", size, start, span);
+
+    word_t last = GET_PAGE(start + size - 1);
+
+    for (word_t page = GET_PAGE(start); page <= last; page++) {
+        if (page >> PAGEMAP_BITS) {
+            DEBUG("Page %lx is past the page map", page);
+            return -1;
+        }
+
+        word_t root = page >> (PAGEMAP_MID_BITS + PAGEMAP_LEAF_BITS);
+        word_t mid = (page >> PAGEMAP_LEAF_BITS)
+            & ((1 << PAGEMAP_MID_BITS) - 1);
+
+        // Lookups don't take the global lock, so entries are published whole
+        pagemap_node_t* node = pagemap[root];
+
+        if (node == NULL) {
+            node = meta_alloc(sizeof(pagemap_node_t));
+            if (node == NULL) {
+                return -1;
+            }
+            __atomic_store_n(&pagemap[root], node, __ATOMIC_RELEASE);
+        }
+
+        pagemap_leaf_t* leaf = node->leaves[mid];
+
+        if (leaf == NULL) {
+            leaf = meta_alloc(sizeof(pagemap_leaf_t));
+            if (leaf == NULL) {
+                return -1;
+            }
+            __atomic_store_n(&node->leaves[mid], leaf, __ATOMIC_RELEASE);
         }
+
+        __atomic_store_n(&leaf->spans[page & ((1 << PAGEMAP_LEAF_BITS) - 1)],
+            span, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static span_t* pagemap_get(const void* ptr)
+{
+    word_t page = GET_PAGE(ptr);
+
+    if (page >> PAGEMAP_BITS) {
+        return NULL;
+    }
+
+    pagemap_node_t* node = __atomic_load_n(
+        &pagemap[page >> (PAGEMAP_MID_BITS + PAGEMAP_LEAF_BITS)],
+        __ATOMIC_ACQUIRE);
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    word_t mid = (page >> PAGEMAP_LEAF_BITS) & ((1 << PAGEMAP_MID_BITS) - 1);
+    pagemap_leaf_t* leaf
+        = __atomic_load_n(&node->leaves[mid], __ATOMIC_ACQUIRE);
+
+    if (leaf == NULL) {
+        return NULL;
+    }
+
+    return __atomic_load_n(
+        &leaf->spans[page & ((1 << PAGEMAP_LEAF_BITS) - 1)], __ATOMIC_ACQUIRE);
+}
+
+#ifdef MLOCK_ENABLE_FREE_INDEX
+static void index_insert(heap_t* heap, byte_t* fp)
+{
+    word_t size = GET_SIZE(fp);
+    index_bin_t* bin = &heap->free_index[SIZE_BIN(size)];
+
+    if (bin->count == bin->capacity) {
+        size_t capacity = bin->capacity ? bin->capacity * 2 : INDEX_CAPACITY;
+        uint32_t* sizes = mmap(NULL, capacity * sizeof(uint32_t),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        byte_t** blocks = mmap(NULL, capacity * sizeof(byte_t*),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (sizes == MAP_FAILED || blocks == MAP_FAILED) {
+            DEBUG("Failed to grow free index; leaving %p out", fp);
+            if (sizes != MAP_FAILED) {
+                munmap(sizes, capacity * sizeof(uint32_t));
+            }
+            if (blocks != MAP_FAILED) {
+                munmap(blocks, capacity * sizeof(byte_t*));
+            }
+            PUT_FREE_SLOT(fp, NOT_INDEXED);
+            return;
+        }
+
+        if (bin->capacity) {
+            memcpy(sizes, bin->sizes, bin->count * sizeof(uint32_t));
+            memcpy(blocks, bin->blocks, bin->count * sizeof(byte_t*));
+            munmap(bin->sizes, bin->capacity * sizeof(uint32_t));
+            munmap(bin->blocks, bin->capacity * sizeof(byte_t*));
+        }
+
+        bin->sizes = sizes;
+        bin->blocks = blocks;
+        bin->capacity = capacity;
+    }
+
+    bin->sizes[bin->count] = GET_GRANULES(size);
+    bin->blocks[bin->count] = fp;
+    PUT_FREE_SLOT(fp, bin->count);
+    bin->count++;
+    heap->index_bins_used |= 1ULL << SIZE_BIN(size);
+}
+
+static void index_remove(heap_t* heap, byte_t* fp)
+{
+    word_t slot = GET_FREE_SLOT(fp);
+
+    if (slot == NOT_INDEXED) {
+        return;
+    }
+
+    int bin_num = SIZE_BIN(GET_SIZE(fp));
+    index_bin_t* bin = &heap->free_index[bin_num];
+    size_t last = --bin->count;
+
+    // Fill the hole with the last entry so the arrays stay dense
+    if (slot != last) {
+        bin->sizes[slot] = bin->sizes[last];
+        bin->blocks[slot] = bin->blocks[last];
+        PUT_FREE_SLOT(bin->blocks[slot], slot);
+    }
+
+    bin->sizes[last] = 0;
+
+    if (bin->count == 0) {
+        heap->index_bins_used &= ~(1ULL << bin_num);
+    }
+}
+
+static byte_t* index_find(heap_t* heap, word_t size)
+{
+    int bin_num = SIZE_BIN(size);
+    index_bin_t* bin = &heap->free_index[bin_num];
+    granule_vec_t wanted = { 0 };
+    wanted += GET_GRANULES(size);
+    byte_t* best = NULL;
+    uint32_t best_size = 0;
+
+    // Blocks in the size's own bin may be too small; compare a vector of
+    // sizes at a time
+    for (size_t i = 0; i < bin->count; i += INDEX_LANES) {
+        granule_vec_t sizes;
+        memcpy(&sizes, bin->sizes + i, sizeof(sizes));
+        granule_vec_t fits = (granule_vec_t)(sizes >= wanted);
+
+        unsigned long long lanes[sizeof(fits) / sizeof(unsigned long long)];
+        memcpy(lanes, &fits, sizeof(fits));
+        unsigned long long any = 0;
+        for (size_t k = 0; k < sizeof(lanes) / sizeof(lanes[0]); k++) {
+            any |= lanes[k];
+        }
+
+        if (!any) {
+            continue;
+        }
+
+        for (size_t k = 0; k < INDEX_LANES && i + k < bin->count; k++) {
+            // Sizes are clamped to 32 bits, so check the real size
+            if (!fits[k] || GET_SIZE(bin->blocks[i + k]) < size) {
+                continue;
+            }
+
+            if (options.fit_policy == MLOCK_FIT_FIRST
+                && options.order_policy == MLOCK_ORDER_LIFO) {
+                DEBUG("Found indexed pointer %p", bin->blocks[i + k]);
+                return bin->blocks[i + k];
+            }
+
+            byte_t* fp = bin->blocks[i + k];
+
+            if (best == NULL || INDEX_BETTER(sizes[k], fp, best_size, best)) {
+                best = fp;
+                best_size = sizes[k];
+            }
+        }
+    }
+
+    if (best != NULL) {
+        DEBUG("Found best indexed pointer %p", best);
+        return best;
+    }
+
+    // Every block in a larger bin fits; take the last so removal is cheap
+    unsigned long long larger = LARGER_BINS(heap->index_bins_used, bin_num);
+
+    if (larger) {
+        bin = &heap->free_index[__builtin_ctzll(larger)];
+        size_t slot = bin->count - 1;
+
+        if (options.fit_policy == MLOCK_FIT_BEST
+            || options.order_policy == MLOCK_ORDER_ADDRESS) {
+            for (size_t i = 0; i < bin->count; i++) {
+                if (INDEX_BETTER(bin->sizes[i], bin->blocks[i],
+                        bin->sizes[slot], bin->blocks[slot])) {
+                    slot = i;
+                }
+            }
+        }
+
+        DEBUG("Found indexed pointer %p", bin->blocks[slot]);
+        return bin->blocks[slot];
     }
 
-    DEBUG("Found no block large enough");
+    DEBUG("Found no indexed block large enough");
     return NULL;
 }
+#endif
 
 /*
  * MIT License
@@ -17,12 +17,14 @@
  *
  *                        63 62 61  .  .  .  3  2  1  0
  *                      +-------------------------------+
- *                      |  s  s  s  .  .  .  s  0  0  a |
+ *                      |  s  s  s  .  .  .  s  t  h  a |
  *                      +-------------------------------+
  *
- * Where s is the size of the block's data in bytes and a is set if the block
- * is allocated.  Blocks are aligned to eight-byte boundaries, which is why the
- * first three bits of the size are inconsequential.
+ * Where s is the size of the block's data in bytes, a is set if the block is
+ * allocated, h is set in the header of a block reported to the hooks, and t is
+ * set in the header of a block whose lifetime is being measured.
+ * Blocks are aligned to eight-byte boundaries, which is why the first three
+ * bits of the size are inconsequential.
  *
  * For free blocks, the first two words of the payload will be pointers to the
  * data of the next free block and the previous free block.  Thus, the smallest
@@ -30,9 +32,141 @@
  * words of header/boundary tag).  Data-wise, the smallest possible block is
  * two words.
  *
- * The free list is LIFO --- only the "first" node of the list is tracked using
- * a global variable, and new frees will be inserted at the start to become the
- * new head.
+ * Free blocks are kept in 64 segregated free lists, one per power-of-two size
+ * bin.  A fit search scans the bin of the requested size, then takes a block
+ * from the next non-empty larger bin, where every block fits.  By default each
+ * list is LIFO --- new frees are inserted at the start to become the new head.
+ * With the `MLOCK_ORDER_ADDRESS` order policy each list is instead kept sorted
+ * by address, so allocation prefers low addresses and live data compacts
+ * toward the start of the heap.  Sorting per bin keeps insertion walks short.
+ *
+ * If `MLOCK_ENABLE_FREE_INDEX` is defined, every free block is also kept in a
+ * side index of power-of-two size bins.  Each bin holds the sizes and
+ * addresses of its blocks in two dense parallel arrays, so a fit search
+ * compares eight sizes per vector instruction instead of following free list
+ * pointers through the heap.  Free blocks then store their slot in the index
+ * as a third payload word, which raises the smallest block data to three
+ * words.
+ *
+ * Every page m-lock manages is recorded in a three-level radix page map, from
+ * page number to the descriptor of the span the page belongs to.  `unlock`
+ * classifies a pointer with a few loads through the page map before touching
+ * any header, and ignores pointers m-lock doesn't manage.
+ *
+ * Allocations can be tagged with a small integer naming the subsystem that
+ * owns them.  A tagged block's data starts with one word holding the tag,
+ * stored shifted left by three so its allocated bit is clear; that is how
+ * `unlock` tells it apart from the header of an untagged block.  Each thread
+ * counts live bytes and blocks per tag privately and only publishes them to
+ * the shared counters once they drift by 64 KiB, so the shared counts can lag
+ * by that much per thread.
+ *
+ * The h bit is set when an allocation was reported to the hooks registered
+ * through `mlock_set_hooks`, so that its free is reported too.  Boundary tags
+ * never carry it.
+ *
+ * Blocks of at least the `color_threshold` option are cache colored: each one
+ * starts a further cache line into the free block it is placed in, rotating
+ * through `color_count` offsets, and the skipped bytes become a free block of
+ * their own.  Otherwise equal-sized large blocks that start at the same page
+ * offset would all compete for the same cache sets.
+ *
+ * Free blocks of at least two pages record when they became free in their
+ * fourth payload word.  Every so many allocator calls, blocks that have been
+ * free longer than the `decay_ms` option have their whole interior pages
+ * purged with `madvise(MADV_DONTNEED)`, and their record is zeroed so they
+ * aren't purged twice.  Memory reused within the decay time never takes the
+ * page faults of being purged and faulted back in.
+ *
+ * The bytes the heap takes from the system can be limited with
+ * `mlock_set_limit`.  When no free block fits and growing would pass the soft
+ * limit, the heap first purges every free page, then runs the callbacks added
+ * with `mlock_add_reclaim` one at a time until a free block fits.  If none
+ * does, the heap grows only by what its free top block lacks.  Growth that
+ * would pass the hard limit fails, and the allocation returns NULL.
+ *
+ * Blocks hinted as short-lived come from a heap of their own, made of
+ * segments mapped with mmap, each at least 1 MiB and laid out like the heap
+ * below.  Blocks never coalesce across segments, and a segment whose blocks
+ * are all freed is unmapped whole, except for the last one left, which is
+ * kept for reuse.  Long-lived survivors then never pin the memory of
+ * short-lived ones.  If anything else moves the program break, the main heap
+ * can't grow in place either and also continues in mapped segments.
+ *
+ * With the `short_lifetime` option set, m-lock learns which call sites
+ * allocate short-lived blocks.  Every sixteenth unhinted allocation is
+ * measured: its site, found by the return address of the call into m-lock,
+ * and the bytes allocated so far are kept in a small table, and the t bit
+ * marks the block.  Freed within `short_lifetime` bytes of allocation, the
+ * block raises its site's score; outliving them, it lowers the score four
+ * times as much.  Sites with a high enough score have their unhinted blocks
+ * placed in the short-lived heap.  The hot path only adds a hash and a table
+ * load.
+ *
+ * Pools hand out objects of one size without any of the heap's size logic or
+ * coalescing.  A pool carves slabs of at least 64 KiB out of page-aligned
+ * heap blocks, and maps their pages to the pool in the page map, so `unlock`
+ * also frees pool objects.  Each thread caches up to 64 free objects per pool
+ * and takes or returns them 32 at a time from the pool's shared free list,
+ * which is linked through the free objects themselves.  Objects cached by a
+ * thread go back to the pool when the thread exits.
+ *
+ * A pool made with mlock_cache_create is an object cache: objects are built
+ * by its constructor when first handed out, and freed objects stay built, so
+ * the next allocation gets them back as they were left.  Their free list link
+ * lives in a word after the object so it doesn't clobber that state.  Each
+ * slab counts the objects handed out to threads; slabs with none are reaped,
+ * running the destructor on their objects, when the heap is about to grow past
+ * its soft limit or mlock_pool_reap is called.
+ *
+ * I/O buffer pools made with mlock_iobufs_create don't come from the heap:
+ * each maps a segment of whole-page buffers of its own, locks it in memory
+ * with mlock(2) and maps its pages to the pool in the page map.  Free buffers
+ * form a lock-free stack linked through their first word, so taking or
+ * returning one costs one compare-and-swap.
+ *
+ * Rings made with mlock_ring are the pages of an anonymous memfd mapped
+ * twice into one reserved range, which the page map records as a span of its
+ * own.
+ *
+ * Threads are spread round-robin over arenas, four per CPU by default or as
+ * many as the `arenas` option asks for.  Each arena is a pair of heaps, one
+ * per lifetime hint, with free lists and segments of its own; only the first
+ * arena's long-lived heap grows with sbrk.  A block is always freed back to
+ * the arena it came from, found through the page map.
+ *
+ * Each thread keeps freed blocks of up to 512 bytes from long-lived heaps in
+ * a cache of its own, one list per 8-byte size class, and allocates from it
+ * without touching the arena.  A class that passes its limit hands half its
+ * blocks to the arena's transfer cache for the class as one batch, and a
+ * class that runs dry takes a whole batch back from there.  Transfer caches
+ * are lock-free stacks of batches, so either costs one compare-and-swap; only
+ * when the transfer cache is full or empty are blocks freed to or allocated
+ * from the heap itself.  The limits start small and adapt: classes that keep
+ * running dry double theirs, classes that mostly overflow halve it.  A
+ * thread's cache is emptied when the thread exits, when it has gone unused
+ * for the `cache_idle_ms` option, and before the heap grows past its soft
+ * limit; transfer caches are emptied alike.
+ *
+ * Each bin of a heap has its own lock.  An allocation that finds a block in
+ * its own bin with too little left over to split takes only that bin's lock,
+ * so threads allocating different sizes don't wait on each other.  Growing
+ * an arena's heaps, splitting and every free take the arena's lock, even a
+ * free whose neighbors are allocated: whether they stay so can only be known
+ * under that lock, as a neighbor freed at the same time must see the block
+ * free to coalesce with it.  Frees that miss the thread caches therefore still
+ * wait on each other within an arena, whatever their sizes.  A thread never
+ * waits on a second arena's lock while holding one: blocks it frees into
+ * another arena meanwhile are left on that arena's remote list, for the
+ * arena's next holder to free.  These locks spin with backoff for a while
+ * before sleeping, as their critical sections are short, and count how often
+ * they're found held.  A global lock guards the page map and allocator
+ * metadata, and pools and thread caches have their own.
+ *
+ * Blocks passed to unlock_deferred wait in per-thread bags, one list per
+ * epoch, until every thread in a read-side critical section has seen the
+ * global epoch move on twice; they're then freed like any other block.  The
+ * epoch is advanced every few deferrals and when reclaiming.
  *
  * The heap has the following form:
  *
@@ -53,17 +187,173 @@
 
 // ---[ INCLUDES ]-------------------------------------------------------------
 
-#include <string.h>  // For memcpy
-#include <unistd.h>  // For sbrk
+#include <string.h>   // For memcpy
+#include <sys/uio.h>  // For struct iovec
+#include <unistd.h>   // For sbrk
+
+// ---[ CONSTANTS ]------------------------------------------------------------
+
+#define MLOCK_MAX_TAGS 64  // Number of allocation tags, including untagged 0
+
+#define MLOCK_MAX_RECLAIMS 8  // Number of reclaim callbacks that can be added
+
+#define MLOCK_MAX_ARENAS 64  // Number of arenas threads can be spread over
+
+#define MLOCK_GROW_FIXED     0  // Grow the heap by the chunk size
+#define MLOCK_GROW_GEOMETRIC 1  // Grow the heap by its own size
+
+#define MLOCK_FIT_FIRST 0  // Take the first free block that fits
+#define MLOCK_FIT_BEST  1  // Take the smallest free block that fits
+
+#define MLOCK_ORDER_LIFO    0  // Free blocks are reused most recent first
+#define MLOCK_ORDER_ADDRESS 1  // Free blocks are reused lowest address first
+
+#define MLOCK_HINT_LONG  0  // The block may live long; the default
+#define MLOCK_HINT_SHORT 1  // The block will be freed soon
+
+// ---[ TYPES ]----------------------------------------------------------------
+
+/**
+ * A pool of fixed-size objects, made by mlock_pool_create.
+ */
+typedef struct mlock_pool mlock_pool_t;
+
+/**
+ * A pool of pinned, page-aligned I/O buffers, made by mlock_iobufs_create.
+ */
+typedef struct mlock_iobufs mlock_iobufs_t;
+
+/**
+ * Live memory of one allocation tag.
+ */
+typedef struct {
+    size_t live_bytes;  // Bytes of block data allocated under the tag
+    size_t live_count;  // Number of blocks allocated under the tag
+} mlock_tag_stats_t;
+
+/**
+ * Contention on the heap's locks since startup.
+ */
+typedef struct {
+    size_t contended;  // Times a thread found a heap lock held
+    size_t spun;       // Times a thread took a held lock by spinning for it
+    size_t parked;     // Times a thread slept waiting for a heap lock
+} mlock_lock_stats_t;
+
+/**
+ * Callbacks run on allocator events.  Any of them may be NULL.  Allocations
+ * made from inside a hook are not reported.
+ */
+typedef struct {
+    /**
+     * Called after a reported allocation with the returned pointer and the
+     * requested size.
+     */
+    void (*on_alloc)(void* ptr, size_t size, void* arg);
+
+    /**
+     * Called before a reported block is freed with its pointer and usable
+     * size.
+     */
+    void (*on_free)(void* ptr, size_t size, void* arg);
+
+    /**
+     * Called after a reported block is resized with its old and new pointers
+     * and the requested size.
+     */
+    void (*on_realloc)(void* old_ptr, void* new_ptr, size_t size, void* arg);
+
+    /**
+     * Called after the heap grows with the new memory's start and size.
+     */
+    void (*on_grow)(void* start, size_t size, void* arg);
+
+    /**
+     * Sample one allocation per this many bytes allocated, or every
+     * allocation if 0.  Frees and resizes are reported only for sampled
+     * blocks, whether or not on_alloc is set.
+     */
+    size_t sample_interval;
+
+    void* arg;  // Argument passed to every hook
+} mlock_hooks_t;
+
+/**
+ * Options for initializing the heap.  Start from mlock_default_options so
+ * fields added later keep their defaults.
+ */
+typedef struct {
+    size_t initial_size;     // Bytes of free heap reserved at startup
+    size_t chunk_size;       // Minimum bytes to grow the heap by
+    int grow_policy;         // One of the MLOCK_GROW_ constants
+    int fit_policy;          // One of the MLOCK_FIT_ constants
+    int order_policy;        // One of the MLOCK_ORDER_ constants
+    size_t split_threshold;  // Smallest leftover split off into a free block
+    size_t color_threshold;  // Smallest block to cache color, or 0 for none
+    size_t color_count;      // Number of cache line offsets to rotate through
+    int prefault;            // Fault in the initial heap at startup if set
+    unsigned long decay_ms;  // Idle time before free pages are purged, or 0
+    size_t short_lifetime;   // Bytes allocated within a short life, or 0
+    unsigned arenas;         // Arenas to spread threads over, or 0 for auto
+    unsigned cache_idle_ms;  // Idle time before thread caches empty, or 0
+} mlock_options_t;
+
+/**
+ * Called when a tag's live bytes cross above its soft limit.
+ * @param tag The allocation tag.
+ * @param live_bytes The tag's live bytes at the time of crossing.
+ * @param arg The argument given when the limit was set.
+ */
+typedef void (*mlock_limit_fn)(int tag, size_t live_bytes, void* arg);
+
+/**
+ * Called before the heap grows past its soft limit, to free memory the
+ * application can spare with unlock.
+ * @param needed The size of the allocation that found no free block.
+ * @param arg The argument given when the callback was added.
+ */
+typedef void (*mlock_reclaim_fn)(size_t needed, void* arg);
+
+/**
+ * Builds an object of a cache.
+ * @param obj The object.
+ * @param arg The argument given when the cache was created.
+ * @returns 0 on success, else -1.
+ */
+typedef int (*mlock_ctor_fn)(void* obj, void* arg);
+
+/**
+ * Tears down an object of a cache built by its constructor.
+ * @param obj The object.
+ * @param arg The argument given when the cache was created.
+ */
+typedef void (*mlock_dtor_fn)(void* obj, void* arg);
 
 // ---[ FUNCTION PROTOTYPES ]--------------------------------------------------
 
 /**
- * Initialize the memory manager.
+ * Initialize the memory manager with default options, overridden by those in
+ * the `MLOCK_OPTIONS` environment variable, e.g.
+ * `MLOCK_OPTIONS=initial_size=64M,grow=geometric,fit=best,order=address`.
+ * Called on the first allocation if not called before.
  * @returns Pointer to the start of the heap on a success, else NULL.
  */
 void* init_lock(void);
 
+/**
+ * Initialize the memory manager with the given options.  Does nothing if the
+ * memory manager is already initialized.
+ * @param options The options, or NULL for the defaults.
+ * @returns Pointer to the start of the heap on a success, else NULL.
+ */
+void* init_lock_ex(const mlock_options_t* options);
+
+/**
+ * Fills the given options with their defaults.
+ * @param options The options to fill.
+ */
+void mlock_default_options(mlock_options_t* options);
+
 /**
  * Allocate a block of at least the given size.
  * @param size The minimum size of the block's data in bytes.
@@ -72,19 +362,301 @@ void* init_lock(void);
 void* mlock(size_t size);
 
 /**
- * Frees the given block by adding it to the free list.
+ * Allocate a block of at least the given size and count it against the given
+ * tag.
+ * @param size The minimum size of the block's data in bytes.
+ * @param tag The allocation tag, from 1 to `MLOCK_MAX_TAGS - 1`.  Any other
+ * value allocates an untagged block.
+ * @returns A pointer to the start of the block's data.
+ */
+void* mlock_tagged(size_t size, int tag);
+
+/**
+ * Allocate a block of at least the given size from the heap for the given
+ * lifetime, whatever was learned about the call site.  The block's lifetime
+ * isn't measured.
+ * @param size The minimum size of the block's data in bytes.
+ * @param hint One of the `MLOCK_HINT_` constants.
+ * @returns A pointer to the start of the block's data.
+ */
+void* mlock_hinted(size_t size, int hint);
+
+/**
+ * Allocate a block of at least the given size as close as possible to an
+ * existing block: from free space next to it, else from the same segment,
+ * else anywhere.  Nodes of a structure allocated next to each other share
+ * pages and cache lines when it is walked.
+ * @param hint A live block returned by m-lock, or NULL.
+ * @param size The minimum size of the block's data in bytes.
+ * @returns A pointer to the start of the block's data.
+ */
+void* mlock_near(const void* hint, size_t size);
+
+/**
+ * Sets the lifetime hint given to this thread's allocations.  Resized blocks
+ * stay in the heap they were allocated from.
+ * @param hint One of the `MLOCK_HINT_` constants.
+ * @returns The thread's previous hint.
+ */
+int mlock_set_hint(int hint);
+
+/**
+ * Creates a pool of fixed-size objects.
+ * @param object_size The size of each object in bytes.
+ * @param alignment Power of two, up to the page size, that objects are aligned
+ * to, or 0 for eight bytes.
+ * @returns The pool, else NULL.
+ */
+mlock_pool_t* mlock_pool_create(size_t object_size, size_t alignment);
+
+/**
+ * Creates a cache of constructed objects.  An object is built by the
+ * constructor the first time it's handed out and keeps its state while free;
+ * the destructor runs only when the cache gives the object's memory back.
+ * @param object_size The size of each object in bytes.
+ * @param alignment Power of two, up to the page size, that objects are aligned
+ * to, or 0 for eight bytes.
+ * @param ctor Called to build each object, or NULL.
+ * @param dtor Called to tear down each built object, or NULL.
+ * @param arg Passed to ctor and dtor.
+ * @returns The cache, else NULL.
+ */
+mlock_pool_t* mlock_cache_create(size_t object_size, size_t alignment,
+    mlock_ctor_fn ctor, mlock_dtor_fn dtor, void* arg);
+
+/**
+ * Allocates an object from the given pool.
+ * @param pool The pool.
+ * @returns A pointer to the object, else NULL.
+ */
+void* mlock_pool_alloc(mlock_pool_t* pool);
+
+/**
+ * Returns an object to the given pool.  Same as unlock, but skips looking up
+ * the pool.
+ * @param pool The pool the object was allocated from.
+ * @param ptr The object, or NULL.
+ */
+void mlock_pool_free(mlock_pool_t* pool, void* ptr);
+
+/**
+ * Gives back the slabs of the given pool that no object is allocated or
+ * cached from, running the destructor on their free objects.
+ * @param pool The pool.
+ * @returns The number of bytes given back to the heap.
+ */
+size_t mlock_pool_reap(mlock_pool_t* pool);
+
+/**
+ * Destroys the given pool and returns all of its memory to the heap, freeing
+ * every object still allocated from it.  The destructor runs on the free
+ * objects held by the pool and this thread, but not on objects still
+ * allocated.  The pool must not be in use by any other thread.
+ * @param pool The pool, or NULL.
+ */
+void mlock_pool_destroy(mlock_pool_t* pool);
+
+/**
+ * Creates a pool of I/O buffers, each starting on a page boundary, in a
+ * segment mapped for them alone and locked in memory once, so they can be
+ * used for `O_DIRECT` and registered with io_uring as they are.  The pool
+ * never grows.
+ * @param buffer_size The size of each buffer in bytes, rounded up to whole
+ * pages.
+ * @param count The number of buffers.
+ * @returns The pool, else NULL if the buffers couldn't be mapped or locked.
+ */
+mlock_iobufs_t* mlock_iobufs_create(size_t buffer_size, size_t count);
+
+/**
+ * Takes a free buffer from the pool.  Safe to call from any thread without
+ * locking.
+ * @param bufs The pool.
+ * @returns A pointer to the start of the buffer, else NULL if every buffer is
+ * in use.
+ */
+void* mlock_iobuf_alloc(mlock_iobufs_t* bufs);
+
+/**
+ * Returns a buffer to its pool.  `unlock` does the same.
+ * @param bufs The pool.
+ * @param buf A buffer taken from the pool, or NULL.
+ */
+void mlock_iobuf_free(mlock_iobufs_t* bufs, void* buf);
+
+/**
+ * Gets the buffers of the pool, in the form io_uring_register_buffers takes.
+ * @param bufs The pool.
+ * @param count Set to the number of buffers.
+ * @returns One iovec per buffer, in order, owned by the pool.
+ */
+const struct iovec* mlock_iobufs_iovecs(const mlock_iobufs_t* bufs,
+    unsigned* count);
+
+/**
+ * Finds which of the pool's iovecs a pointer falls in, to use as the buffer
+ * index of fixed-buffer I/O.
+ * @param bufs The pool.
+ * @param buf A pointer into one of the pool's buffers.
+ * @returns The index of the buffer, else -1.
+ */
+int mlock_iobuf_index(const mlock_iobufs_t* bufs, const void* buf);
+
+/**
+ * Destroys the given pool and unmaps its buffers, which must all be free and
+ * unregistered from any io_uring.
+ * @param bufs The pool, or NULL.
+ */
+void mlock_iobufs_destroy(mlock_iobufs_t* bufs);
+
+/**
+ * Maps a ring buffer whose pages are mapped twice, back to back, so that
+ * `ring[i]` and `ring[i + size]` are the same byte and reads or writes that
+ * wrap around the end stay contiguous.  Compilers don't know the two halves
+ * alias, so a byte written through one shouldn't be read back through the
+ * other without a compiler barrier in between.  Rings don't come from the
+ * heap.
+ * @param size The size of the ring in bytes, rounded up to whole pages.
+ * @returns A pointer to the start of the ring, followed by its second
+ * mapping, else NULL.
+ */
+void* mlock_ring(size_t size);
+
+/**
+ * Unmaps a ring made by mlock_ring.  `unlock` does the same.
+ * @param ring The pointer mlock_ring returned.
+ */
+void unlock_ring(void* ring);
+
+/**
+ * Returns the pages of free blocks that have been free for at least the given
+ * time to the system.  The heap does the same on its own for blocks idle
+ * longer than the `decay_ms` option.  Thread caches unused for as long are
+ * emptied first.
+ * @param idle_ms Minimum time in milliseconds, or 0 for all free blocks.
+ * @returns The number of bytes purged.
+ */
+size_t mlock_purge(unsigned long idle_ms);
+
+/**
+ * Reports how often threads have had to wait on the heap's locks.  Each
+ * arena and free list bin has a lock that spins briefly, then sleeps, when
+ * it's held.
+ * @param stats Filled with counts of contended, spun and slept acquisitions.
+ */
+void mlock_lock_stats(mlock_lock_stats_t* stats);
+
+/**
+ * Enters a read-side critical section.  Blocks other threads pass to
+ * unlock_deferred from then on stay allocated until the section is left.
+ * Sections nest, and are cheap to enter and leave.
+ */
+void mlock_epoch_enter(void);
+
+/**
+ * Leaves a read-side critical section, freeing blocks this thread deferred
+ * that no other thread can still be reading.
+ */
+void mlock_epoch_exit(void);
+
+/**
+ * Frees the given block once every thread that was in a read-side critical
+ * section when it was called has left it, so lock-free structures can free
+ * nodes that readers may still be traversing.  The block must already be
+ * unreachable for readers that enter afterwards.
+ * @param ptr A pointer from any m-lock allocation function, or NULL.
+ */
+void unlock_deferred(void* ptr);
+
+/**
+ * Limits the bytes the heap takes from the system.  Past the soft limit the
+ * heap reclaims memory before growing; it never grows past the hard limit.
+ * @param soft The soft limit in bytes, or 0 for none.
+ * @param hard The hard limit in bytes, or 0 for none.
+ * @returns 0 on success, -1 if the soft limit is above the hard limit.
+ */
+int mlock_set_limit(size_t soft, size_t hard);
+
+/**
+ * Adds a callback run before the heap grows past its soft limit.  Callbacks
+ * run in the order they were added, until enough memory is freed.  They run
+ * on the allocating thread with no m-lock lock held, so they may allocate,
+ * free, and wait on other threads, except when the allocation was itself made
+ * from a hook, destructor or reclaim callback.  Allocations made by a
+ * callback never reclaim.
+ * @param fn The callback.
+ * @param arg Argument passed to the callback.
+ * @returns 0 on success, -1 if fn is NULL or `MLOCK_MAX_RECLAIMS` callbacks
+ * were already added.
+ */
+int mlock_add_reclaim(mlock_reclaim_fn fn, void* arg);
+
+/**
+ * Registers allocation event hooks, replacing any registered before.  Safe to
+ * call while other threads allocate, so a profiler can attach to a running
+ * program; hooks already being called may still be called once more from the
+ * set they replaced.  Each call keeps a small copy of the hooks for good.
+ * @param hooks The hooks to copy, or NULL to remove them.
+ */
+void mlock_set_hooks(const mlock_hooks_t* hooks);
+
+/**
+ * Sets the tag given to this thread's allocations made through mlock.
+ * @param tag The allocation tag, or 0 to stop tagging.
+ * @returns The thread's previous tag.
+ */
+int mlock_set_tag(int tag);
+
+/**
+ * Reads the live memory of the given tag.  Counts may lag behind by up to
+ * 64 KiB per thread besides the calling one.
+ * @param tag The allocation tag.
+ * @param stats Filled with the tag's live memory.
+ */
+void mlock_tag_stats(int tag, mlock_tag_stats_t* stats);
+
+/**
+ * Sets a soft limit for the given tag.  The callback runs once each time the
+ * tag's live bytes cross above the limit; allocation is never refused.  Safe
+ * to call while other threads allocate under the tag; the limit, callback and
+ * argument are replaced together.  Each call keeps a small copy for good.
+ * @param tag The allocation tag.
+ * @param soft_limit The limit in bytes, or 0 to remove it.
+ * @param fn Callback to run when the limit is crossed, or NULL.
+ * @param arg Argument passed to the callback.
+ * @returns 0 on success, -1 if the tag is invalid or the limit couldn't be
+ * copied.
+ */
+int mlock_tag_limit(int tag, size_t soft_limit, mlock_limit_fn fn, void* arg);
+
+/**
+ * Frees the given block by adding it to the free list.  Pointers that m-lock
+ * doesn't manage are ignored.
  * @param bp Pointer to the start of a block's data.
  */
 void unlock(void* ptr);
 
 /**
- * Re-allocates the given pointer to a block of the given size.
+ * Re-allocates the given pointer to a block of the given size.  Only blocks
+ * from mlock, mlock_tagged, mlock_hinted and mlock_near can be resized; pool
+ * objects, I/O buffers, rings and pointers m-lock doesn't manage are left
+ * alone and NULL is returned, as when memory runs out.
  * @param ptr Pointer to the start of a block's data.
  * @param size The new size of the block in bytes.
- * @returns The new pointer.
+ * @returns The new pointer, else NULL with the block untouched.
  */
 void* relock(void* ptr, size_t size);
 
+/**
+ * Resizes the given block without moving it, by shrinking it or by growing
+ * into the next block if that block is free.  Safe for data that can't be
+ * moved with memcpy.  Takes the same blocks as relock.
+ * @param ptr Pointer to the start of a block's data.
+ * @param size The new size of the block in bytes.
+ * @returns ptr on success, else NULL with the block untouched.
+ */
+void* relock_inplace(void* ptr, size_t size);
+
 #endif
 
 /*
@@ -1,7 +1,10 @@
 // #define MLOCK_ENABLE_DEBUG
 // #define MLOCK_WORD_SIZE 4
 #include "../src/mlock.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <time.h>
 
 #define REQUIRED_ARGS                                                         \
@@ -9,10 +12,730 @@
 
 #define BOOLEAN_ARGS                                                          \
     BOOLEAN_ARG(malloc, "--malloc", "Use the standard library's malloc")      \
-    BOOLEAN_ARG(parallel, "--parallel", "Use mlock and malloc in parallel")
+    BOOLEAN_ARG(parallel, "--parallel", "Use mlock and malloc in parallel")   \
+    BOOLEAN_ARG(check, "--check", "Check threads and every allocator feature")
 
 #include "easyargs.h"
 
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                #cond);                                                       \
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);               \
+        }                                                                     \
+    } while (0)
+
+#define THREADS    8
+#define ITERATIONS 20000
+#define SLOTS      64
+#define CHECK_TAG  7
+
+static int failures = 0;
+
+static void* shared_slots[SLOTS];  // Blocks handed between threads
+static int* published = NULL;      // Node read under epochs, or NULL
+static int stop_readers = 0;
+
+static unsigned next_random(unsigned* seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void fill(unsigned char* ptr, size_t size, unsigned char byte)
+{
+    memset(ptr, byte, size);
+}
+
+static int filled(const unsigned char* ptr, size_t size, unsigned char byte)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (ptr[i] != byte) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Allocates, resizes and frees blocks of mixed sizes, and hands some to
+ * other threads to free, so blocks cross thread caches, transfer caches and
+ * arenas.
+ */
+static void* churn(void* arg)
+{
+    unsigned seed = (unsigned)(uintptr_t)arg * 2654435761u + 1;
+    unsigned char byte = (unsigned char)(uintptr_t)arg + 1;
+    unsigned char* held[16] = { NULL };
+    size_t sizes[16] = { 0 };
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int k = next_random(&seed) % 16;
+
+        if (held[k] != NULL) {
+            CHECK(filled(held[k], sizes[k], byte));
+            size_t size = next_random(&seed) % 4096 + 1;
+
+            if (next_random(&seed) % 4 == 0) {
+                unsigned char* moved = relock(held[k], size);
+                CHECK(moved != NULL);
+                size_t kept = size < sizes[k] ? size : sizes[k];
+                CHECK(moved == NULL || filled(moved, kept, byte));
+                held[k] = moved;
+                sizes[k] = moved ? size : 0;
+
+                if (moved != NULL) {
+                    fill(moved, size, byte);
+                }
+                continue;
+            }
+
+            // Blocks given away are freed by whichever thread takes them
+            void* old = __atomic_exchange_n(
+                &shared_slots[k * 4 + byte % 4], held[k], __ATOMIC_ACQ_REL);
+            unlock(old);
+            held[k] = NULL;
+            continue;
+        }
+
+        sizes[k] = next_random(&seed) % 600 + 1;
+        held[k] = k % 3 == 0 && held[(k + 1) % 16] != NULL
+            ? mlock_near(held[(k + 1) % 16], sizes[k])
+            : mlock(sizes[k]);
+        CHECK(held[k] != NULL);
+        fill(held[k], sizes[k], byte);
+    }
+
+    for (int k = 0; k < 16; k++) {
+        unlock(held[k]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads the published node inside epochs while a writer replaces it.
+ */
+static void* read_epochs(void* arg)
+{
+    (void)arg;
+
+    while (!__atomic_load_n(&stop_readers, __ATOMIC_ACQUIRE)) {
+        mlock_epoch_enter();
+        int* node = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+
+        // Linger, so a node freed too early is caught being reused
+        for (int i = 0; node != NULL && i < 16 * 64; i++) {
+            CHECK(node[i % 16] == node[0]);
+        }
+
+        mlock_epoch_exit();
+    }
+
+    return NULL;
+}
+
+static void check_threads(void)
+{
+    pthread_t threads[THREADS];
+
+    for (uintptr_t i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, churn, (void*)i);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < SLOTS; i++) {
+        unlock(shared_slots[i]);
+        shared_slots[i] = NULL;
+    }
+}
+
+static void check_epochs(void)
+{
+    pthread_t readers[THREADS / 2];
+
+    for (int i = 0; i < THREADS / 2; i++) {
+        pthread_create(&readers[i], NULL, read_epochs, NULL);
+    }
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int* node = mlock(sizeof(int) * 16);
+        CHECK(node != NULL);
+
+        for (int k = 0; k < 16; k++) {
+            node[k] = i;
+        }
+
+        unlock_deferred(__atomic_exchange_n(&published, node,
+            __ATOMIC_ACQ_REL));
+    }
+
+    __atomic_store_n(&stop_readers, 1, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < THREADS / 2; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    unlock_deferred(__atomic_exchange_n(&published, NULL, __ATOMIC_ACQ_REL));
+    mlock_purge(0);
+}
+
+static int constructed = 0;
+static int destroyed = 0;
+
+static int construct(void* obj, void* arg)
+{
+    (void)arg;
+    memset(obj, 0xAB, 48);
+    constructed++;
+    return 0;
+}
+
+static void destroy(void* obj, void* arg)
+{
+    (void)arg;
+    CHECK(filled(obj, 48, 0xAB));
+    destroyed++;
+}
+
+static void check_pools(void)
+{
+    mlock_pool_t* pool = mlock_pool_create(24, 16);
+    CHECK(pool != NULL);
+    void* objs[1000];
+
+    for (int i = 0; i < 1000; i++) {
+        objs[i] = mlock_pool_alloc(pool);
+        CHECK(objs[i] != NULL && (uintptr_t)objs[i] % 16 == 0);
+        fill(objs[i], 24, (unsigned char)i);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        CHECK(filled(objs[i], 24, (unsigned char)i));
+
+        if (i % 2) {
+            unlock(objs[i]);
+        } else {
+            mlock_pool_free(pool, objs[i]);
+        }
+    }
+
+    mlock_pool_destroy(pool);
+
+    // Freed objects of a cache come back as they were left
+    mlock_pool_t* cache = mlock_cache_create(48, 8, construct, destroy, NULL);
+    CHECK(cache != NULL);
+
+    for (int i = 0; i < 1000; i++) {
+        objs[i] = mlock_pool_alloc(cache);
+        CHECK(objs[i] != NULL && filled(objs[i], 48, 0xAB));
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        mlock_pool_free(cache, objs[i]);
+    }
+
+    mlock_pool_reap(cache);
+    mlock_pool_destroy(cache);
+    CHECK(constructed > 0 && destroyed == constructed);
+}
+
+static void check_rings(void)
+{
+    size_t size = 3 * 4096;
+    unsigned char* ring = mlock_ring(size - 100);
+    CHECK(ring != NULL);
+
+    if (ring == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        ring[i] = (unsigned char)i;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        CHECK(ring[i + size] == (unsigned char)i);
+    }
+
+    unlock_ring(ring);
+}
+
+static void check_iobufs(void)
+{
+    mlock_iobufs_t* bufs = mlock_iobufs_create(4000, 8);
+
+    if (bufs == NULL) {
+        fprintf(stderr, "Skipping I/O buffers; pages can't be locked here\n");
+        return;
+    }
+
+    unsigned count;
+    const struct iovec* iovecs = mlock_iobufs_iovecs(bufs, &count);
+    CHECK(count == 8);
+    void* taken[9];
+
+    for (int i = 0; i < 9; i++) {
+        taken[i] = mlock_iobuf_alloc(bufs);
+    }
+
+    CHECK(taken[8] == NULL);
+
+    for (int i = 0; i < 8; i++) {
+        int index = mlock_iobuf_index(bufs, taken[i]);
+        CHECK(taken[i] != NULL && (uintptr_t)taken[i] % 4096 == 0);
+        CHECK(index >= 0 && iovecs[index].iov_base == taken[i]);
+        CHECK(iovecs[index].iov_len == 4096);
+
+        if (i % 2) {
+            unlock(taken[i]);
+        } else {
+            mlock_iobuf_free(bufs, taken[i]);
+        }
+    }
+
+    CHECK(mlock_iobuf_alloc(bufs) != NULL);
+    mlock_iobufs_destroy(bufs);
+}
+
+/**
+ * @param name An option name.
+ * @returns Whether the option was given in `MLOCK_OPTIONS`.
+ */
+static int option_given(const char* name)
+{
+    const char* env = getenv("MLOCK_OPTIONS");
+    return env != NULL && strstr(env, name) != NULL;
+}
+
+/**
+ * Allocates and frees 64-byte blocks at one call site, as young as blocks
+ * get, then allocates one more there.
+ * @param young Hint given to the young blocks, or -1 for none.
+ * @param last Hint given to the last block, or -1 for none.
+ * @returns Whether the last block came from the main heap, whose small
+ * blocks are handed back from the thread cache in LIFO order; the
+ * short-lived heap doesn't cache them.
+ */
+static int last_from_main_heap(int young, int last)
+{
+    void* freed = NULL;
+    void* ptr = NULL;
+
+    for (int i = 0; i <= 4096; i++) {
+        int hint = young;
+
+        if (i == 4096) {
+            freed = mlock(64);
+            unlock(freed);
+            hint = last;
+        }
+
+        ptr = hint < 0 ? mlock(64) : mlock_hinted(64, hint);
+        unlock(ptr);
+    }
+
+    return ptr == freed;
+}
+
+static void check_hints(void)
+{
+    CHECK(!last_from_main_heap(-1, MLOCK_HINT_SHORT));
+
+    // Short-lived blocks hinted at a site teach nothing about it, so a long
+    // hint there still gets the main heap
+    CHECK(last_from_main_heap(MLOCK_HINT_SHORT, MLOCK_HINT_LONG));
+
+    // Unhinted blocks freed young teach their site to allocate short-lived
+    CHECK(last_from_main_heap(-1, -1) != option_given("short_lifetime"));
+}
+
+static int crossings = 0;
+static int limit_marks[2];  // Arguments set with each limit callback
+
+static void count_crossing(int tag, size_t live_bytes, void* arg)
+{
+    CHECK(tag == CHECK_TAG && live_bytes > 0);
+    CHECK(arg == &limit_marks[0]);
+    __atomic_add_fetch(&crossings, 1, __ATOMIC_RELAXED);
+}
+
+static void other_crossing(int tag, size_t live_bytes, void* arg)
+{
+    CHECK(tag == CHECK_TAG && live_bytes > 0);
+    CHECK(arg == &limit_marks[1]);
+}
+
+/**
+ * Takes and frees tagged blocks in bursts that cross the tag's limit.
+ */
+static void* churn_tagged(void* arg)
+{
+    (void)arg;
+    void* held[64];
+    mlock_set_tag(CHECK_TAG);
+
+    for (int i = 0; i < ITERATIONS / 64; i++) {
+        for (int k = 0; k < 64; k++) {
+            held[k] = mlock(4096);
+        }
+
+        for (int k = 0; k < 64; k++) {
+            unlock(held[k]);
+        }
+    }
+
+    mlock_set_tag(0);
+    return NULL;
+}
+
+static void check_tags(void)
+{
+    mlock_tag_stats_t stats;
+    CHECK(mlock_set_tag(CHECK_TAG) == 0);
+    void* tagged = mlock(100);
+    CHECK(mlock_set_tag(0) == CHECK_TAG);
+    void* explicit = mlock_tagged(200, CHECK_TAG);
+    mlock_tag_stats(CHECK_TAG, &stats);
+    CHECK(stats.live_count == 2 && stats.live_bytes >= 300);
+
+    unlock(tagged);
+    unlock(explicit);
+    mlock_tag_stats(CHECK_TAG, &stats);
+    CHECK(stats.live_count == 0 && stats.live_bytes == 0);
+
+    // Each burst crosses the limit once on the way up
+    CHECK(mlock_tag_limit(0, 1, count_crossing, NULL) == -1);
+    CHECK(mlock_tag_limit(CHECK_TAG, 1 << 17, count_crossing, &limit_marks[0])
+        == 0);
+    churn_tagged(NULL);
+    CHECK(crossings == ITERATIONS / 64);
+
+    // Callbacks always get the argument set along with them
+    pthread_t threads[THREADS];
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, churn_tagged, NULL);
+    }
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        mlock_tag_limit(CHECK_TAG, 1 << 17,
+            i % 2 ? other_crossing : count_crossing, &limit_marks[i % 2]);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(mlock_tag_limit(CHECK_TAG, 0, NULL, NULL) == 0);
+}
+
+static int reclaims = 0;
+
+static void count_reclaim(size_t needed, void* arg)
+{
+    (void)needed;
+    (void)arg;
+    reclaims++;
+
+    // Small blocks go through this thread's cache, which the allocation
+    // that reclaimed may be refilling
+    for (int i = 0; i < 16; i++) {
+        unlock(mlock(40));
+    }
+}
+
+static void check_limits(void)
+{
+    CHECK(mlock_add_reclaim(count_reclaim, NULL) == 0);
+    CHECK(mlock_set_limit(2, 1) == -1);
+
+    // No growth fits a one-byte hard limit, so only reclaiming could help
+    CHECK(mlock_set_limit(0, 1) == 0);
+    CHECK(mlock(1 << 26) == NULL);
+    CHECK(reclaims > 0);
+
+    CHECK(mlock_set_limit(0, 0) == 0);
+    void* big = mlock(1 << 26);
+    CHECK(big != NULL);
+    unlock(big);
+
+    // Past a one-byte soft limit every growth reclaims, so small blocks are
+    // taken until one refills the cache by growing the heap
+    int before = reclaims;
+    void** list = NULL;
+    CHECK(mlock_set_limit(1, 0) == 0);
+
+    while (reclaims == before) {
+        void** link = mlock(40);
+        *link = list;
+        list = link;
+    }
+
+    CHECK(mlock_set_limit(0, 0) == 0);
+
+    while (list != NULL) {
+        void** next = *list;
+        unlock(list);
+        list = next;
+    }
+}
+
+static void check_inplace(void)
+{
+    // Shrinking splits off the tail, which growing then takes back
+    unsigned char* ptr = mlock(8192);
+    fill(ptr, 256, 0x5a);
+    CHECK(relock_inplace(ptr, 256) == ptr);
+    CHECK(relock_inplace(ptr, 4096) == ptr);
+    CHECK(filled(ptr, 256, 0x5a));
+
+    // A block that can't grow where it is, for want of memory or once the
+    // block after it is taken, stays as it was
+    CHECK(relock_inplace(ptr, (size_t)1 << 40) == NULL);
+    void* next = mlock_near(ptr, 64);
+    CHECK(relock_inplace(ptr, 4096 + 256) == NULL);
+    CHECK(filled(ptr, 256, 0x5a));
+    unlock(next);
+
+    int local = 0;
+    CHECK(relock_inplace(&local, 8) == NULL);
+    unlock(ptr);
+}
+
+static void check_order(void)
+{
+    void* blocks[8];
+    void* spacers[8];
+
+    // Blocks too big for the thread cache and too small to color; spacers
+    // right after each keep the freed blocks from coalescing
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = mlock(768);
+        spacers[i] = mlock_near(blocks[i], 64);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        unlock(blocks[i]);
+    }
+
+    // By address order, freed blocks come back lowest address first, though
+    // blocks other threads' caches free meanwhile may come in between
+    void* freed[8];
+    char* last = NULL;
+    int ascending = 1;
+    memcpy(freed, blocks, sizeof(freed));
+
+    for (int i = 0; i < 8; i++) {
+        blocks[i] = mlock(768);
+
+        for (int k = 0; k < 8; k++) {
+            if (blocks[i] == freed[k]) {
+                ascending &= (char*)blocks[i] > last;
+                last = blocks[i];
+            }
+        }
+    }
+
+    CHECK(ascending || !option_given("order=address"));
+
+    for (int i = 0; i < 8; i++) {
+        unlock(blocks[i]);
+        unlock(spacers[i]);
+    }
+}
+
+static void check_colors(void)
+{
+    unsigned char* blocks[16];
+    int lines[4096 / 64] = { 0 };
+    int distinct = 0;
+
+    for (int i = 0; i < 16; i++) {
+        blocks[i] = mlock(4096);
+        fill(blocks[i], 4096, (unsigned char)i);
+        int line = (uintptr_t)blocks[i] % 4096 / 64;
+        distinct += lines[line]++ == 0;
+    }
+
+    // Colored blocks start on cache lines spread over the page
+    CHECK(distinct >= 8 || !option_given("color_threshold"));
+
+    for (int i = 0; i < 16; i++) {
+        CHECK(filled(blocks[i], 4096, (unsigned char)i));
+        unlock(blocks[i]);
+    }
+}
+
+static void check_purge(void)
+{
+    size_t size = 4 << 20;
+    char* big = mlock(size);
+    memset(big, 1, size);
+    mlock_purge(0);
+    unlock(big);
+
+    // The block has only just been freed, and once purged isn't purged again
+    CHECK(mlock_purge(60 * 1000) == 0);
+    CHECK(mlock_purge(0) >= size - 2 * 4096);
+    CHECK(mlock_purge(0) == 0);
+
+    // Past the decay time the allocator purges it on its own
+    big = mlock(size);
+    memset(big, 1, size);
+    unlock(big);
+    nanosleep(&(struct timespec) { .tv_nsec = 50 * 1000 * 1000 }, NULL);
+
+    for (int i = 0; i < 4096; i++) {
+        unlock(mlock(4096));
+    }
+
+    CHECK((mlock_purge(0) < size / 2) == option_given("decay_ms"));
+}
+
+/**
+ * @param before Lock stats taken before threads churned the heap.
+ */
+static void check_lock_stats(const mlock_lock_stats_t* before)
+{
+    mlock_lock_stats_t after;
+    mlock_lock_stats(&after);
+    CHECK(after.contended >= before->contended);
+    CHECK(after.spun >= before->spun && after.parked >= before->parked);
+    CHECK(after.spun - before->spun <= after.contended - before->contended);
+
+    // Threads sharing one arena's lock find it held sooner or later
+    CHECK(after.contended > before->contended || !option_given("arenas=1"));
+}
+
+static int grows = 0;
+
+static void count_grow(void* start, size_t size, void* arg)
+{
+    (void)start;
+    (void)size;
+    (void)arg;
+    grows++;
+}
+
+static void check_options(void)
+{
+    mlock_options_t opts;
+    mlock_default_options(&opts);
+    CHECK(opts.grow_policy == MLOCK_GROW_FIXED);
+    CHECK(opts.fit_policy == MLOCK_FIT_FIRST);
+    CHECK(opts.order_policy == MLOCK_ORDER_LIFO);
+    CHECK(opts.color_threshold == 0 && opts.short_lifetime == 0);
+
+    // The heap is already initialized, so these only return its start
+    void* start = init_lock();
+    CHECK(start != NULL);
+    CHECK(init_lock_ex(&opts) == start && init_lock_ex(NULL) == start);
+
+    // A heap reserved at startup takes a big block without growing, and
+    // prefaulted, touching it takes next to no page faults
+    mlock_hooks_t hooks = { .on_grow = count_grow };
+    struct rusage before, after;
+    size_t size = 16 << 20;
+    mlock_set_hooks(&hooks);
+    getrusage(RUSAGE_SELF, &before);
+    char* big = mlock(size);
+    memset(big, 1, size);
+    getrusage(RUSAGE_SELF, &after);
+    mlock_set_hooks(NULL);
+    unlock(big);
+
+    CHECK((grows == 0) == option_given("initial_size"));
+
+    if (option_given("prefault")) {
+        CHECK(after.ru_minflt - before.ru_minflt < size / 4096 / 16);
+    }
+}
+
+static struct {
+    int allocs;
+    int frees;
+    int reallocs;
+    void* ptr;    // Pointer of the last event
+    size_t size;  // Size of the last event
+} events;
+
+static void on_alloc_event(void* ptr, size_t size, void* arg)
+{
+    CHECK(arg == &events);
+    events.allocs++;
+    events.ptr = ptr;
+    events.size = size;
+
+    // Allocations made from a hook aren't reported
+    unlock(mlock(32));
+}
+
+static void on_free_event(void* ptr, size_t size, void* arg)
+{
+    CHECK(arg == &events);
+    events.frees++;
+    events.ptr = ptr;
+    events.size = size;
+}
+
+static void on_realloc_event(void* old_ptr, void* new_ptr, size_t size,
+    void* arg)
+{
+    CHECK(arg == &events && old_ptr != NULL);
+    events.reallocs++;
+    events.ptr = new_ptr;
+    events.size = size;
+}
+
+static void check_hooks(void)
+{
+    mlock_hooks_t hooks = {
+        .on_alloc = on_alloc_event,
+        .on_free = on_free_event,
+        .on_realloc = on_realloc_event,
+        .arg = &events,
+    };
+    mlock_set_hooks(&hooks);
+
+    void* ptr = mlock(100);
+    CHECK(events.allocs == 1 && events.ptr == ptr && events.size == 100);
+    ptr = relock(ptr, 5000);
+    CHECK(events.reallocs == 1 && events.ptr == ptr && events.size == 5000);
+    unlock(ptr);
+    CHECK(events.frees == 1 && events.ptr == ptr && events.size >= 5000);
+
+    // Sampled by bytes, frees are reported for sampled blocks only, with or
+    // without on_alloc
+    void* held[256];
+    hooks.on_alloc = NULL;
+    hooks.sample_interval = 1 << 16;
+    mlock_set_hooks(&hooks);
+    memset(&events, 0, sizeof(events));
+
+    for (int i = 0; i < 256; i++) {
+        held[i] = mlock(1024);
+    }
+
+    for (int i = 0; i < 256; i++) {
+        unlock(held[i]);
+    }
+
+    CHECK(events.allocs == 0 && events.frees > 0 && events.frees < 64);
+
+    int frees = events.frees;
+    mlock_set_hooks(NULL);
+    unlock(mlock(100));
+    CHECK(events.allocs == 0 && events.frees == frees);
+}
+
 int main(int argc, char** argv)
 {
     args_t args = make_default_args();
@@ -46,6 +769,31 @@ int main(int argc, char** argv)
         init_lock();
     }
 
+    if (args.check && !args.malloc) {
+        mlock_lock_stats_t before;
+        check_options();
+        mlock_lock_stats(&before);
+        check_threads();
+        check_lock_stats(&before);
+        check_epochs();
+        check_pools();
+        check_rings();
+        check_iobufs();
+        check_hints();
+        check_limits();
+        check_tags();
+        check_hooks();
+        check_inplace();
+        check_order();
+        check_colors();
+        check_purge();
+        fprintf(stderr, "checks done with %d failures\n", failures);
+
+        if (failures) {
+            return 1;
+        }
+    }
+
     clock_t time = clock();
 
     int* arr = alloc_fn(sizeof(int) * 10);